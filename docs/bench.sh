@@ -0,0 +1,34 @@
+#!/bin/sh
+# Compare the double and fixed point phase lock builds, on the replay
+# of test.dat and on a simulated run, for both results and speed.
+#
+# Usage: docs/bench.sh [POLLS] [-- CONFIGURE ARGS]
+#
+# Run from the top of the source tree, after ./autogen.sh.  Extra
+# configure arguments, e.g. --host=arm-linux-gnueabi, are passed on to
+# both builds.  Set RUN, e.g. RUN=qemu-arm, to run a cross build.
+set -e
+
+POLLS=${1:-200000}
+[ $# -gt 0 ] && shift
+[ "$1" = "--" ] && shift
+
+TOP=$(pwd)
+DIR=$(mktemp -d)
+trap 'rm -rf "$DIR"' EXIT
+
+for variant in double fixed; do
+	mkdir -p "$DIR/$variant"
+	opt=""
+	[ $variant = fixed ] && opt=--enable-fixed-point
+	(cd "$DIR/$variant" && "$TOP/configure" -q --enable-replay $opt "$@" && make -s) >/dev/null
+done
+
+for variant in double fixed; do
+	echo "== $variant"
+	$RUN "$DIR/$variant/src/sntpd" -r "$TOP/docs/test.dat"
+	start=$(date +%s.%N)
+	$RUN "$DIR/$variant/src/sntpd" -S polls="$POLLS"
+	end=$(date +%s.%N)
+	echo "$start $end $POLLS" | awk '{ t = $2 - $1; printf "# %.3f sec, %.0f polls/sec\n", t, $3 / t }'
+done
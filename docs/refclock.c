@@ -0,0 +1,181 @@
+/* Fake reference clock, feeds sntpd -R without a GPS receiver
+ *
+ * Copyright (C) 2010-2022  Joachim Wiberg <troglobit@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License (Version 2,
+ * June 1991) as published by the Free Software Foundation.  At the
+ * time of writing, that license was published by the FSF with the URL
+ * http://www.gnu.org/copyleft/gpl.html, and is incorporated herein by
+ * reference.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+/*
+ * Writes one sample a second, the reference OFFSET usec ahead of the
+ * system clock, +/- 10 usec of noise, the way gpsd does:
+ *
+ *     cc -o refclock docs/refclock.c
+ *     sntpd -n -d -i 15 -R sock:/tmp/rc.sock nonexistent.invalid &
+ *     ./refclock sock:/tmp/rc.sock 250
+ *
+ * Start sntpd first, it creates both the socket and the segment.  Use
+ * shm:N for ntpd's shared memory segment N.  After a poll or two sntpd
+ * logs "Selecting refclock", also with the server unreachable.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ipc.h>
+#include <sys/shm.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+
+#define SHM_KEY    0x4e545030	/* "NTP0" */
+#define SOCK_MAGIC 0x534f434b	/* "SOCK" */
+
+/* Same layouts as in src/refclock.c */
+struct shm_time {
+	int          mode;
+	volatile int count;
+	time_t       clock_sec;
+	int          clock_usec;
+	time_t       recv_sec;
+	int          recv_usec;
+	int          leap;
+	int          precision;
+	int          nsamples;
+	volatile int valid;
+	unsigned     clock_nsec;
+	unsigned     recv_nsec;
+	int          dummy[8];
+};
+
+struct sock_sample {
+	struct timeval tv;
+	double offset;
+	int    pulse;
+	int    leap;
+	int    pad;
+	int    magic;
+};
+
+static int usage(void)
+{
+	fprintf(stderr, "Usage: refclock shm:N | sock:PATH [OFFSET [COUNT]]\n"
+		"  OFFSET  usec, reference - system clock, default: 250\n"
+		"  COUNT   samples, one per second, default: forever\n");
+	return 1;
+}
+
+static int sock_write(const char *path, const struct timeval *tv, double offset)
+{
+	struct sockaddr_un sa;
+	struct sock_sample s;
+	int sd, rc;
+
+	memset(&s, 0, sizeof(s));
+	s.tv     = *tv;
+	s.offset = offset;
+	s.magic  = SOCK_MAGIC;
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sun_family = AF_UNIX;
+	strncpy(sa.sun_path, path, sizeof(sa.sun_path) - 1);
+
+	sd = socket(AF_UNIX, SOCK_DGRAM, 0);
+	if (sd == -1)
+		return -1;
+	rc = sendto(sd, &s, sizeof(s), 0, (struct sockaddr *)&sa, sizeof(sa));
+	close(sd);
+
+	return rc == -1 ? -1 : 0;
+}
+
+/* ntpd's mode 1 protocol, count is odd while the writer is busy */
+static void shm_write(struct shm_time *t, const struct timeval *tv, double offset)
+{
+	long long ns = tv->tv_sec * 1000000000LL + tv->tv_usec * 1000LL + (long long)(offset * 1e9);
+
+	t->mode = 1;
+	t->valid = 0;
+	t->count++;
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	t->recv_sec   = tv->tv_sec;
+	t->recv_usec  = tv->tv_usec;
+	t->recv_nsec  = tv->tv_usec * 1000;
+	t->clock_sec  = ns / 1000000000LL;
+	t->clock_nsec = ns % 1000000000LL;
+	t->clock_usec = t->clock_nsec / 1000;
+	t->precision  = -20;
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	t->count++;
+	t->valid = 1;
+}
+
+int main(int argc, char *argv[])
+{
+	struct shm_time *shm = NULL;
+	const char *path = NULL;
+	double offset = 250;
+	int count = -1;
+
+	if (argc < 2)
+		return usage();
+	if (argc > 2)
+		offset = atof(argv[2]);
+	if (argc > 3)
+		count = atoi(argv[3]);
+
+	if (!strncmp(argv[1], "sock:", 5)) {
+		path = argv[1] + 5;
+	} else if (!strncmp(argv[1], "shm:", 4)) {
+		int id;
+
+		id = shmget(SHM_KEY + atoi(argv[1] + 4), sizeof(*shm), 0);
+		if (id == -1) {
+			perror("shmget, is sntpd running");
+			return 1;
+		}
+		shm = shmat(id, NULL, 0);
+		if (shm == (void *)-1) {
+			perror("shmat");
+			return 1;
+		}
+	} else {
+		return usage();
+	}
+
+	srand(time(NULL));
+	while (count == -1 || count-- > 0) {
+		double off = (offset + rand() % 21 - 10) / 1e6;
+		struct timeval tv;
+
+		gettimeofday(&tv, NULL);
+		if (shm)
+			shm_write(shm, &tv, off);
+		else if (sock_write(path, &tv, off))
+			perror("sendto, is sntpd running");
+		sleep(1);
+	}
+
+	if (shm)
+		shmdt(shm);
+
+	return 0;
+}
+
+/**
+ * Local Variables:
+ *  indent-tabs-mode: t
+ *  c-file-style: "linux"
+ * End:
+ */
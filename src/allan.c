@@ -0,0 +1,132 @@
+/* Streaming Allan deviation, TDEV and MTIE of the measured offset
+ *
+ * Copyright (C) 2010-2022  Joachim Wiberg <troglobit@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License (Version 2,
+ * June 1991) as published by the Free Software Foundation.  At the
+ * time of writing, that license was published by the FSF with the URL
+ * http://www.gnu.org/copyleft/gpl.html, and is incorporated herein by
+ * reference.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+/*
+ * The offsets of accepted samples are the phase x(t) of the local clock
+ * against the server.  Level k of a cascade of ALLAN_TAUS levels sees
+ * every 2^k:th sample, tau = 2^k * tau0, and hands every other input to
+ * level k + 1, so a sample costs two level updates on average and the
+ * memory is fixed.  Per level:
+ *
+ *   ADEV^2 = < (x[i+2] - 2x[i+1] + x[i])^2 > / (2 tau^2)
+ *   TDEV^2 = < (X[i+2] - 2X[i+1] + X[i])^2 > / 6
+ *   MTIE   = max (max x - min x) over windows of tau
+ *
+ * where x[i] are every 2^k:th sample and X[i] averages of 2^k samples.
+ * These are the non-overlapping estimators, with fewer degrees of
+ * freedom than the overlapping ones, and MTIE only sees windows aligned
+ * to 2^k samples, so it is a lower bound.  Samples are not evenly spaced,
+ * lost polls and bursts, so tau is the mean spacing seen at each level.
+ *
+ * With the clock disciplined, short tau is dominated by the network,
+ * white phase noise, ADEV falling as 1/tau, and long tau by the residual
+ * wander of the oscillator and the loop.
+ */
+
+#include "config.h"
+#include <math.h>
+#include <sys/param.h>		/* MIN()/MAX() */
+#include "sntpd.h"
+
+void allan_reset(struct allan *a)
+{
+	memset(a, 0, sizeof(*a));
+}
+
+/*
+ * Input to level k: a sample t, x, the average of the 2^k samples up to
+ * it, and the range of the window of 2^k + 1 samples ending with it.
+ */
+static void allan_level(struct allan *a, int k, double t, double x, double avg, double lo, double hi)
+{
+	struct allan_level *l = &a->level[k];
+
+	if (hi - lo > l->mtie)
+		l->mtie = hi - lo;
+
+	if (l->num >= 2) {
+		double d = x - 2 * l->x[1] + l->x[0];
+		double e = avg - 2 * l->avg[1] + l->avg[0];
+
+		l->sum_adev += d * d;
+		l->sum_tdev += e * e;
+		l->sum_tau  += (t - l->t[0]) / 2;
+		l->count++;
+	}
+
+	/* Every other input goes up, paired with the one before it */
+	if ((l->num & 1) && k + 1 < ALLAN_TAUS)
+		allan_level(a, k + 1, l->t[1], l->x[1], (l->avg[1] + avg) / 2,
+			    MIN(l->lo, lo), MAX(l->hi, hi));
+
+	l->t[0]   = l->t[1];
+	l->t[1]   = t;
+	l->x[0]   = l->x[1];
+	l->x[1]   = x;
+	l->avg[0] = l->avg[1];
+	l->avg[1] = avg;
+	l->lo     = lo;
+	l->hi     = hi;
+	l->num++;
+}
+
+/* Add a sample, t in sec and x, the offset, in usec */
+void allan_add(struct allan *a, double t, double x)
+{
+	double prev = a->num ? a->prev : x;
+
+	allan_level(a, 0, t, x, x, MIN(prev, x), MAX(prev, x));
+	a->prev = x;
+	a->num++;
+}
+
+/*
+ * Fill in p[] with the levels that have at least one estimate, shortest
+ * tau first, at most max.  Returns the number of levels.
+ */
+int allan_get(const struct allan *a, struct allan_point *p, int max)
+{
+	int i, n = 0;
+
+	for (i = 0; i < ALLAN_TAUS && n < max; i++) {
+		const struct allan_level *l = &a->level[i];
+		double tau;
+
+		if (!l->count)
+			break;
+
+		tau = l->sum_tau / l->count;
+		if (tau <= 0)
+			break;
+
+		p[n].tau  = tau;
+		p[n].adev = sqrt(l->sum_adev / (2 * l->count)) / 1e6 / tau;
+		p[n].tdev = sqrt(l->sum_tdev / (6 * l->count));
+		p[n].mtie = l->mtie;
+		p[n].num  = l->count;
+		n++;
+	}
+
+	return n;
+}
+
+/**
+ * Local Variables:
+ *  indent-tabs-mode: t
+ *  c-file-style: "linux"
+ * End:
+ */
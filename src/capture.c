@@ -0,0 +1,135 @@
+/* Binary capture of NTP exchanges
+ *
+ * Copyright (C) 2010-2022  Joachim Wiberg <troglobit@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License (Version 2,
+ * June 1991) as published by the Free Software Foundation.  At the
+ * time of writing, that license was published by the FSF with the URL
+ * http://www.gnu.org/copyleft/gpl.html, and is incorporated herein by
+ * reference.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+/*
+ * Every reply that passes check_source() is appended, before any
+ * validation, as one fixed size record:
+ *
+ *     struct capture_hdr    once, at start of file
+ *     struct capture_rec    T1, T4, kernel freq, 48 byte reply
+ *
+ * all fields in network byte order, so a capture can be replayed on any
+ * host, see replay.c.  Records are written with a single write() to an
+ * O_APPEND file, a crash at worst leaves a partial last record, which
+ * the reader ignores, and which is cut off before appending again, not
+ * to misalign all records after it.  The file is reopened on SIGHUP,
+ * for logrotate.
+ */
+
+#include "config.h"
+#include <fcntl.h>
+#include "sntpd.h"
+
+static const char *capture_file;
+static int capture_fd = -1;
+
+/*
+ * Open, or create, capture file.  An existing file is appended to if
+ * it has a matching header, after its last whole record.  Returns 0 on
+ * success, -1 on error.
+ */
+int capture_open(const char *file)
+{
+	struct capture_hdr hdr;
+	off_t len, part;
+
+	capture_close();
+	if (!file)
+		return 0;
+
+	capture_fd = open(file, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+	if (capture_fd == -1) {
+		ERR(errno, "Failed opening capture file %s", file);
+		return -1;
+	}
+
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, CAPTURE_MAGIC, sizeof(hdr.magic));
+	hdr.reclen = htonl(sizeof(struct capture_rec));
+
+	len = lseek(capture_fd, 0, SEEK_END);
+	if (len == 0) {
+		if (write(capture_fd, &hdr, sizeof(hdr)) != sizeof(hdr)) {
+			ERR(errno, "Failed writing capture file %s", file);
+			goto fail;
+		}
+	} else {
+		struct capture_hdr old;
+
+		if (pread(capture_fd, &old, sizeof(old), 0) != sizeof(old) ||
+		    memcmp(&old, &hdr, sizeof(old))) {
+			ERR(0, "Capture file %s is not an sntpd capture, not appending", file);
+			goto fail;
+		}
+
+		part = (len - sizeof(hdr)) % sizeof(struct capture_rec);
+		if (part) {
+			LOG("Capture file %s ends in a partial record, removing %lld bytes",
+			    file, (long long)part);
+			if (ftruncate(capture_fd, len - part)) {
+				ERR(errno, "Failed truncating capture file %s", file);
+				goto fail;
+			}
+		}
+	}
+	capture_file = file;
+
+	return 0;
+fail:
+	close(capture_fd);
+	capture_fd = -1;
+
+	return -1;
+}
+
+/* Append one exchange, on error the capture is stopped */
+void capture_write(uint32_t *data, struct ntptime *t1, struct ntptime *t4, int freq)
+{
+	struct capture_rec rec;
+
+	if (capture_fd == -1)
+		return;
+
+	rec.t1.coarse = htonl(t1->coarse);
+	rec.t1.fine   = htonl(t1->fine);
+	rec.t4.coarse = htonl(t4->coarse);
+	rec.t4.fine   = htonl(t4->fine);
+	rec.freq      = htonl(freq);
+	rec.reserved  = 0;
+	memcpy(rec.data, data, sizeof(rec.data));
+
+	if (write(capture_fd, &rec, sizeof(rec)) != sizeof(rec)) {
+		ERR(errno, "Failed writing capture file %s, stopping capture", capture_file);
+		capture_close();
+	}
+}
+
+void capture_close(void)
+{
+	if (capture_fd == -1)
+		return;
+
+	close(capture_fd);
+	capture_fd = -1;
+}
+
+/**
+ * Local Variables:
+ *  indent-tabs-mode: t
+ *  c-file-style: "linux"
+ * End:
+ */
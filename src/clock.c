@@ -0,0 +1,331 @@
+/* Clock control for NTP client
+ *
+ * Copyright (C) 1997-2015  Larry Doolittle <larry@doolittle.boa.org>
+ * Copyright (C) 2010-2022  Joachim Wiberg <troglobit@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License (Version 2,
+ * June 1991) as published by the Free Software Foundation.  At the
+ * time of writing, that license was published by the FSF with the URL
+ * http://www.gnu.org/copyleft/gpl.html, and is incorporated herein by
+ * reference.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+/*
+ * All changes to the system clock go through here.  The kernel timex
+ * state is cached, every adjtimex() call returns the full state, so
+ * the cache is refreshed on our own writes and otherwise only every
+ * CLOCK_REFRESH seconds, in case someone else has been tampering with
+ * it, or after a failed call.  Status bits are only written when they
+ * change, and the error estimates every CLOCK_SYNC seconds unless they
+ * grow, so a sample costs at most one syscall.  Failures are logged
+ * and reported to the caller, who decides if it is fatal or not, e.g.
+ * an EPERM in a container should not take down the daemon.
+ *
+ * For offline analysis the system clock can be replaced with another
+ * backend, e.g. the virtual clock of the simulator in sim.c.
+ */
+
+#include "config.h"
+#include <math.h>		/* floor(), fabs() */
+#include <time.h>
+#include "sntpd.h"
+
+/* Largest offset, usec, the kernel PLL takes, it clamps larger ones */
+#define KERNEL_MAXPHASE 500000.0
+
+/* Seconds between verifying the cached kernel state */
+#ifndef CLOCK_REFRESH
+#define CLOCK_REFRESH 3600
+#endif
+
+/* Seconds between error estimate updates, unless the error grows */
+#ifndef CLOCK_SYNC
+#define CLOCK_SYNC 1024
+#endif
+
+/* The kernel grows maxerror by this, usec per second, MAXFREQ */
+#define KERNEL_TOLERANCE 500
+
+static const struct clock_ops *ops;
+
+/* Replace the system clock with another backend, NULL to restore */
+void clock_override(const struct clock_ops *backend)
+{
+	ops = backend;
+}
+
+#ifdef __linux__
+static struct timex cache;
+static time_t cache_stamp;
+static int cache_valid;
+static time_t sync_stamp;	/* last error estimate update */
+
+static time_t uptime(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec;
+}
+
+/* Call adjtimex() and refresh cache with the resulting kernel state */
+static int kernel_adjtimex(struct timex *txc, const char *what)
+{
+	if (adjtimex(txc) < 0) {
+		ERR(errno, "Failed adjtimex(%s)", what);
+		cache_valid = 0;	/* unknown what took effect */
+		return -1;
+	}
+
+	txc->modes  = 0;
+	cache       = *txc;
+	cache_stamp = uptime();
+	cache_valid = 1;
+
+	return 0;
+}
+
+/* Read the kernel state, if forced or the cache is old or invalid */
+static int kernel_refresh(int force)
+{
+	struct timex txc;
+
+	if (!force && cache_valid && uptime() - cache_stamp < CLOCK_REFRESH)
+		return 0;
+
+	memset(&txc, 0, sizeof(txc));
+	return kernel_adjtimex(&txc, "GET");
+}
+#endif
+
+/* OS dependent routine to get the current value of clock frequency */
+int get_current_freq(void)
+{
+	if (ops)
+		return ops->get_freq();
+#ifdef __linux__
+	kernel_refresh(0);	/* on error the last known, or 0 */
+
+	return cache.freq;
+#else
+	return 0;
+#endif
+}
+
+/*
+ * OS dependent routine to set a new value of clock frequency.  Returns
+ * 0 on success, -1 on error.
+ */
+int set_freq(int new_freq)
+{
+#ifdef __linux__
+	struct timex txc;
+#endif
+
+	if (ops)
+		return ops->set_freq(new_freq);
+#ifdef __linux__
+
+	memset(&txc, 0, sizeof(txc));
+	txc.modes = ADJ_FREQUENCY;
+	txc.freq  = new_freq;
+
+	return kernel_adjtimex(&txc, "SET");
+#else
+	return 0;
+#endif
+}
+
+/*
+ * OS dependent routine to set the frequency after an accepted sample,
+ * and tell the kernel the clock is synchronized, with the maximum and
+ * estimated error in microseconds, all in one call.  The kernel grows
+ * maxerror by 500 ppm on its own, and marks the clock unsynchronized
+ * again if it is not updated for hours, so the estimates are only sent
+ * every CLOCK_SYNC seconds, or when they exceed what the kernel has.
+ * Nothing is sent if nothing changed.  Returns 0 on success, -1 on error.
+ */
+int set_sync(int new_freq, double maxerror, double esterror)
+{
+#ifdef __linux__
+	struct timex txc;
+	time_t now;
+	int modes;
+#endif
+
+	if (ops) {
+		/* no kernel status in other backends */
+		if (new_freq == ops->get_freq())
+			return 0;
+		return ops->set_freq(new_freq);
+	}
+#ifdef __linux__
+	/* Fresh status before clearing STA_UNSYNC, not to lose other bits */
+	if (kernel_refresh(cache.status & STA_UNSYNC))
+		return -1;
+
+	now = uptime();
+	memset(&txc, 0, sizeof(txc));
+	if (new_freq != cache.freq) {
+		txc.modes |= ADJ_FREQUENCY;
+		txc.freq   = new_freq;
+	}
+	if (cache.status & STA_UNSYNC) {
+		txc.modes |= ADJ_STATUS;
+		txc.status = cache.status & ~STA_UNSYNC;
+	}
+	if ((txc.modes & ADJ_STATUS) || !sync_stamp || now - sync_stamp >= CLOCK_SYNC ||
+	    esterror > cache.esterror || maxerror > cache.maxerror + KERNEL_TOLERANCE * (now - cache_stamp)) {
+		txc.modes   |= ADJ_MAXERROR | ADJ_ESTERROR;
+		txc.maxerror = (long)maxerror;
+		txc.esterror = (long)esterror;
+	}
+	if (!txc.modes)
+		return 0;
+
+	modes = txc.modes;
+	if (kernel_adjtimex(&txc, "SYNC"))
+		return -1;
+	if (modes & ADJ_MAXERROR)
+		sync_stamp = now;
+
+	return 0;
+#else
+	return 0;
+#endif
+}
+
+/*
+ * OS dependent routine to hand a filtered offset, in microseconds, to
+ * the kernel PLL.  The kernel then slews the phase continuously until
+ * the next update and disciplines the frequency on its own.  Beyond a
+ * poll interval of 2048 sec the Linux kernel switches to FLL mode.
+ * Offsets the kernel would clamp are stepped instead.  The status is
+ * only written when it changes, from the cached kernel state.  Returns
+ * 0, 1 if the clock was stepped, or -1 on error.
+ */
+int set_offset(double offset, double maxerror, double esterror, int poll_exp)
+{
+#ifdef __linux__
+	struct timex txc;
+#endif
+
+	if (ops) {
+		errno = ENOTSUP;	/* no kernel PLL in other backends */
+		return -1;
+	}
+#ifdef __linux__
+	if (fabs(offset) > KERNEL_MAXPHASE) {
+		LOG("Offset %.1f usec beyond kernel PLL range, stepping clock", offset);
+		return set_time(offset, 0) ? -1 : 1;
+	}
+
+	if (kernel_refresh(0))
+		return -1;
+
+	/* Other bits, e.g. a pending leap second, are kept */
+	memset(&txc, 0, sizeof(txc));
+	txc.modes    = ADJ_OFFSET | ADJ_NANO | ADJ_TIMECONST | ADJ_MAXERROR | ADJ_ESTERROR;
+	txc.offset   = (long)(offset * 1000);	/* nanoseconds with ADJ_NANO */
+	txc.status   = (cache.status | STA_PLL | STA_NANO) & ~(STA_UNSYNC | STA_FLL);
+	if (txc.status != cache.status)
+		txc.modes |= ADJ_STATUS;
+	txc.maxerror = (long)maxerror;
+	txc.esterror = (long)esterror;
+	/* Linux adds 4 to the time constant, like BusyBox ntpd we compensate */
+	txc.constant = poll_exp > 4 ? poll_exp - 4 : 0;
+
+	return kernel_adjtimex(&txc, "OFFSET");
+#else
+	return 0;
+#endif
+}
+
+/*
+ * Step (or slew) the clock by offset microseconds.  The offset is
+ * relative to the current time, so any time spent between receiving
+ * the reply and getting here does not add to the error.  Offsets
+ * smaller than the step threshold are slewed by the kernel instead.
+ * Returns 0 on success, -1 on error.
+ */
+int set_time(double offset, int threshold)
+{
+	struct timespec ts;
+	double sec;
+
+	if (ops)
+		return ops->set_time(offset, threshold);
+
+	/* normalize to tv_sec + [0, 1) second, negative offsets included */
+	sec = floor(offset / 1e6);
+	ts.tv_sec  = (time_t)sec;
+	ts.tv_nsec = (long)((offset - sec * 1e6) * 1000);
+	if (ts.tv_nsec >= 1000000000) {
+		ts.tv_sec++;
+		ts.tv_nsec -= 1000000000;
+	}
+
+	if (threshold > 0 && fabs(offset) < threshold) {
+		struct timeval tv;
+
+		tv.tv_sec  = ts.tv_sec;
+		tv.tv_usec = ts.tv_nsec / 1000;
+		if (adjtime(&tv, NULL) < 0) {
+			ERR(errno, "Failed adjtime()");
+			return -1;
+		}
+
+		PROBE(clock_slew, (long long)(offset * 1000));
+		DBG("Slewing time %.1f usec", offset);
+		return 0;
+	}
+
+#ifdef HAVE_CLOCK_ADJTIME
+	{
+		struct timex txc;
+
+		memset(&txc, 0, sizeof(txc));
+		txc.modes        = ADJ_SETOFFSET | ADJ_NANO;
+		txc.time.tv_sec  = ts.tv_sec;
+		txc.time.tv_usec = ts.tv_nsec;	/* nanoseconds with ADJ_NANO */
+		if (clock_adjtime(CLOCK_REALTIME, &txc) < 0) {
+			ERR(errno, "Failed clock_adjtime()");
+			return -1;
+		}
+	}
+#else
+	{
+		struct timespec now;
+
+		/* fallback, not atomic: read-modify-write of the clock */
+		clock_gettime(CLOCK_REALTIME, &now);
+		now.tv_sec  += ts.tv_sec;
+		now.tv_nsec += ts.tv_nsec;
+		if (now.tv_nsec >= 1000000000) {
+			now.tv_sec++;
+			now.tv_nsec -= 1000000000;
+		}
+		if (clock_settime(CLOCK_REALTIME, &now) < 0) {
+			ERR(errno, "Failed clock_settime()");
+			return -1;
+		}
+	}
+#endif
+
+	PROBE(clock_step, (long long)(offset * 1000));
+	DBG("Stepped time %.1f usec", offset);
+	return 0;
+}
+
+/**
+ * Local Variables:
+ *  indent-tabs-mode: t
+ *  c-file-style: "linux"
+ * End:
+ */
@@ -0,0 +1,514 @@
+/* Control socket, query and reconfigure a running sntpd
+ *
+ * Copyright (C) 2010-2022  Joachim Wiberg <troglobit@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License (Version 2,
+ * June 1991) as published by the Free Software Foundation.  At the
+ * time of writing, that license was published by the FSF with the URL
+ * http://www.gnu.org/copyleft/gpl.html, and is incorporated herein by
+ * reference.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+/*
+ * A line protocol on a UNIX stream socket, only accessible to the owner
+ * of sntpd.  Each command is one line, the reply is zero or more lines
+ * followed by a line with OK, or ERROR and a reason:
+ *
+ *     tracking           offset, delay, jitter, frequency, poll, ...
+ *     sources            the upstream server and its reachability
+ *     stats              counters, ADEV, TDEV and MTIE of the offset
+ *     burst [NUM]        poll now, and NUM more times every MIN_INTERVAL
+ *     server NAME        change upstream server, keeps the phase lock
+ *     poll [SEC]         show or change poll interval
+ *     loglevel [LEVEL]   show or change log level
+ *     help               list commands
+ *
+ * The socket and its clients are served from the client's select() in
+ * loop(), so commands run in the client thread and need no locking.
+ * Replies are sent without blocking, a client that does not read them
+ * is disconnected.  Try: sntpd -u /run/sntpd.sock -c tracking
+ */
+
+#include "config.h"
+#include <ctype.h>
+#include <stdarg.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include "sntpd.h"
+
+#define CONTROL_CLIENTS 4
+#define CONTROL_LINE    256
+#define CONTROL_REPLY   2048
+#define CONTROL_BURST   16	/* max polls in a burst */
+
+#define NELEMS(arr) (sizeof(arr) / sizeof(arr[0]))
+
+static struct {
+	int    sd;
+	size_t len;
+	char   buf[CONTROL_LINE];
+} clients[CONTROL_CLIENTS];
+
+static int control_sd = -1;
+static char *control_path;
+static char server[256];	/* set with 'server' command */
+
+struct reply {
+	size_t len;
+	char   buf[CONTROL_REPLY];
+};
+
+static void out(struct reply *r, const char *fmt, ...) __attribute__ ((format (printf, 2, 3)));
+static void out(struct reply *r, const char *fmt, ...)
+{
+	va_list ap;
+	int n;
+
+	if (r->len >= sizeof(r->buf))
+		return;
+
+	va_start(ap, fmt);
+	n = vsnprintf(r->buf + r->len, sizeof(r->buf) - r->len, fmt, ap);
+	va_end(ap);
+
+	if (n > 0)
+		r->len += n;
+	if (r->len > sizeof(r->buf))
+		r->len = sizeof(r->buf);
+}
+
+static int sockaddr(struct sockaddr_un *sa, const char *path)
+{
+	memset(sa, 0, sizeof(*sa));
+	sa->sun_family = AF_UNIX;
+	if (strlen(path) >= sizeof(sa->sun_path)) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	strcpy(sa->sun_path, path);
+
+	return 0;
+}
+
+static int do_tracking(struct reply *r, struct ntp_control *ntpc, char *arg)
+{
+	struct ntp_metrics m;
+	struct ntptime now;
+
+	metrics_get(&m);
+	ntpc_gettime(&now);
+
+	out(r, "server          %s\n", ntpc->server);
+	out(r, "offset          %.1f usec\n", m.offset);
+	out(r, "delay           %.1f usec\n", m.delay);
+	out(r, "jitter          %.1f usec\n", m.jitter);
+	out(r, "frequency       %.3f ppm\n", get_current_freq() / 65536.0);
+	out(r, "poll            %d sec\n", ntpc->cycle_time);
+	out(r, "reach           %03o\n", m.reach);
+	if (m.last)
+		out(r, "last sample     %u sec ago\n", now.coarse - m.last);
+	else
+		out(r, "last sample     never\n");
+	out(r, "root delay      %.6f sec\n", m.root_delay);
+	out(r, "root dispersion %.6f sec\n", m.root_dispersion);
+	out(r, "holdover        %s\n", peer.holdover ? "yes" : "no");
+	out(r, "engine          %s\n", ntpc->kernel_pll ? "kernel" :
+	    phaselock_defaults.engine == PHASELOCK_KALMAN ? "kalman" : "polygon");
+
+	return 0;
+}
+
+static int do_sources(struct reply *r, struct ntp_control *ntpc, char *arg)
+{
+	struct ntp_metrics m;
+
+	metrics_get(&m);
+	out(r, "%-32s %5s %8s %12s %10s\n", "server", "reach", "polls", "offset/us", "delay/us");
+	out(r, "%-32s %5o %8llu %12.1f %10.1f\n", ntpc->server, m.reach, m.polls, m.offset, m.delay);
+
+	return 0;
+}
+
+static int do_stats(struct reply *r, struct ntp_control *ntpc, char *arg)
+{
+	struct server_stats ss;
+	struct ntp_metrics m;
+	int i;
+
+	metrics_get(&m);
+	server_stats(&ss);
+	out(r, "polls           %llu\n", m.polls);
+	out(r, "samples         %llu\n", m.samples);
+	out(r, "server requests %lu\n", ss.requests);
+	out(r, "server replies  %lu\n", ss.replies);
+	out(r, "server drops    %lu\n", ss.drops);
+	if (!m.num_dev)
+		return 0;
+
+	out(r, "\n%10s %12s %12s %12s %8s\n", "tau/s", "adev", "tdev/us", "mtie/us", "num");
+	for (i = 0; i < m.num_dev; i++)
+		out(r, "%10.0f %12.3e %12.3f %12.3f %8lu\n", m.dev[i].tau,
+		    m.dev[i].adev, m.dev[i].tdev, m.dev[i].mtie, m.dev[i].num);
+
+	return 0;
+}
+
+static int do_burst(struct reply *r, struct ntp_control *ntpc, char *arg)
+{
+	int num = 4;
+
+	if (arg)
+		num = atoi(arg);
+	if (num < 0 || num > CONTROL_BURST) {
+		out(r, "ERROR burst is 0..%d polls\n", CONTROL_BURST);
+		return -1;
+	}
+	ntpc->burst = num;
+
+	return CONTROL_POLL;
+}
+
+static int do_server(struct reply *r, struct ntp_control *ntpc, char *arg)
+{
+	if (!arg) {
+		out(r, "ERROR missing server name\n");
+		return -1;
+	}
+	if (strlen(arg) >= sizeof(server)) {
+		out(r, "ERROR server name too long\n");
+		return -1;
+	}
+
+	LOG("Changing time sync server from %s to %s", ntpc->server, arg);
+	strcpy(server, arg);
+	ntpc->server = server;
+	metrics_server(server);
+
+	return CONTROL_RESYNC;
+}
+
+static int do_poll(struct reply *r, struct ntp_control *ntpc, char *arg)
+{
+	int sec;
+
+	if (!arg) {
+		out(r, "poll            %d sec\n", ntpc->cycle_time);
+		return 0;
+	}
+
+	sec = atoi(arg);
+	if (sec < MIN_INTERVAL) {
+		out(r, "ERROR poll interval must be at least %d sec\n", MIN_INTERVAL);
+		return -1;
+	}
+	INFO("Changing poll interval from %d to %d sec", ntpc->cycle_time, sec);
+	ntpc->cycle_time = sec;
+
+	return CONTROL_POLL;
+}
+
+static int do_loglevel(struct reply *r, struct ntp_control *ntpc, char *arg)
+{
+	int level;
+
+	if (!arg) {
+		out(r, "loglevel        %s\n", log_lvl2str(log_getlevel()));
+		return 0;
+	}
+
+	/* name, or its prefix, or number */
+	level = log_str2lvl(arg);
+	if (!strcmp(log_lvl2str(level), "unknown") ||
+	    (!isdigit(*arg) && strncasecmp(log_lvl2str(level), arg, strlen(arg)))) {
+		out(r, "ERROR unknown log level %s\n", arg);
+		return -1;
+	}
+	log_setlevel(level);
+
+	return 0;
+}
+
+static int do_help(struct reply *r, struct ntp_control *ntpc, char *arg);
+
+static const struct {
+	const char *name;
+	int (*cb)(struct reply *r, struct ntp_control *ntpc, char *arg);
+	const char *help;
+} cmds[] = {
+	{ "tracking", do_tracking, "Offset, delay, jitter, frequency, poll, ..." },
+	{ "sources",  do_sources,  "Upstream server and its reachability"     },
+	{ "stats",    do_stats,    "Counters, ADEV, TDEV and MTIE of offset"  },
+	{ "burst",    do_burst,    "[NUM]  Poll now, and NUM more times"      },
+	{ "server",   do_server,   "NAME   Change upstream server"            },
+	{ "poll",     do_poll,     "[SEC]  Show or change poll interval"      },
+	{ "loglevel", do_loglevel, "[LEVEL]  Show or change log level"        },
+	{ "help",     do_help,     "This help text"                           },
+};
+
+static int do_help(struct reply *r, struct ntp_control *ntpc, char *arg)
+{
+	size_t i;
+
+	for (i = 0; i < NELEMS(cmds); i++)
+		out(r, "%-10s %s\n", cmds[i].name, cmds[i].help);
+
+	return 0;
+}
+
+static int control_cmd(struct reply *r, struct ntp_control *ntpc, char *line)
+{
+	char *cmd, *arg;
+	size_t i;
+	int rc;
+
+	cmd = strtok(line, " \t\r");
+	arg = strtok(NULL, " \t\r");
+	if (!cmd)
+		return 0;
+
+	for (i = 0; i < NELEMS(cmds); i++) {
+		if (strcmp(cmd, cmds[i].name))
+			continue;
+
+		rc = cmds[i].cb(r, ntpc, arg);
+		if (rc >= 0)
+			out(r, "OK\n");
+
+		return rc < 0 ? 0 : rc;
+	}
+	out(r, "ERROR unknown command %s, try help\n", cmd);
+
+	return 0;
+}
+
+static void drop(int i)
+{
+	close(clients[i].sd);
+	clients[i].sd = -1;
+}
+
+/* Read from client i, run all complete commands */
+static int serve(int i, struct ntp_control *ntpc)
+{
+	struct reply r = { 0 };
+	char *nl, *line;
+	ssize_t num;
+	int act = 0;
+
+	num = recv(clients[i].sd, clients[i].buf + clients[i].len,
+		   sizeof(clients[i].buf) - clients[i].len - 1, MSG_DONTWAIT);
+	if (num <= 0) {
+		if (num == 0 || (errno != EAGAIN && errno != EINTR))
+			drop(i);
+		return 0;
+	}
+	clients[i].len += num;
+	clients[i].buf[clients[i].len] = 0;
+
+	line = clients[i].buf;
+	while ((nl = strchr(line, '\n'))) {
+		*nl = 0;
+		act |= control_cmd(&r, ntpc, line);
+		line = nl + 1;
+	}
+	clients[i].len -= line - clients[i].buf;
+	memmove(clients[i].buf, line, clients[i].len);
+
+	if (clients[i].len >= sizeof(clients[i].buf) - 1) {
+		out(&r, "ERROR line too long\n");
+		clients[i].len = 0;
+	}
+
+	if (r.len && send(clients[i].sd, r.buf, r.len, MSG_DONTWAIT | MSG_NOSIGNAL) != (ssize_t)r.len)
+		drop(i);
+
+	return act;
+}
+
+/* Add control socket and clients to fds, returns highest descriptor */
+int control_fds(fd_set *fds, int max)
+{
+	int i;
+
+	if (control_sd == -1)
+		return max;
+
+	FD_SET(control_sd, fds);
+	if (control_sd > max)
+		max = control_sd;
+
+	for (i = 0; i < CONTROL_CLIENTS; i++) {
+		if (clients[i].sd == -1)
+			continue;
+
+		FD_SET(clients[i].sd, fds);
+		if (clients[i].sd > max)
+			max = clients[i].sd;
+	}
+
+	return max;
+}
+
+/*
+ * Serve control socket and clients that are ready in fds.  Returns
+ * CONTROL_POLL if the client should poll now, CONTROL_RESYNC if it
+ * should reopen its socket, e.g. new server, otherwise 0.
+ */
+int control_handle(fd_set *fds, struct ntp_control *ntpc)
+{
+	int i, sd, act = 0;
+
+	if (control_sd == -1)
+		return 0;
+
+	for (i = 0; i < CONTROL_CLIENTS; i++) {
+		if (clients[i].sd != -1 && FD_ISSET(clients[i].sd, fds))
+			act |= serve(i, ntpc);
+	}
+
+	if (FD_ISSET(control_sd, fds)) {
+		sd = accept(control_sd, NULL, NULL);
+		if (sd == -1)
+			return act;
+
+		for (i = 0; i < CONTROL_CLIENTS; i++) {
+			if (clients[i].sd == -1)
+				break;
+		}
+		if (i == CONTROL_CLIENTS) {
+			close(sd);	/* busy */
+			return act;
+		}
+		clients[i].sd  = sd;
+		clients[i].len = 0;
+	}
+
+	return act;
+}
+
+/* Open control socket at path, owner only.  Returns 0 on success */
+int control_init(const char *path)
+{
+	struct sockaddr_un sa;
+	mode_t mask;
+	int i;
+
+	for (i = 0; i < CONTROL_CLIENTS; i++)
+		clients[i].sd = -1;
+
+	if (sockaddr(&sa, path))
+		goto fail;
+
+	control_sd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (control_sd == -1)
+		goto fail;
+
+	unlink(path);
+	mask = umask(0077);
+	i = bind(control_sd, (struct sockaddr *)&sa, sizeof(sa));
+	umask(mask);
+	if (i || listen(control_sd, CONTROL_CLIENTS)) {
+		close(control_sd);
+		control_sd = -1;
+		goto fail;
+	}
+	control_path = strdup(path);
+
+	return 0;
+fail:
+	ERR(errno, "Failed opening control socket %s", path);
+	return -1;
+}
+
+void control_exit(void)
+{
+	int i;
+
+	if (control_sd == -1)
+		return;
+
+	for (i = 0; i < CONTROL_CLIENTS; i++) {
+		if (clients[i].sd != -1)
+			drop(i);
+	}
+	close(control_sd);
+	control_sd = -1;
+
+	if (control_path) {
+		unlink(control_path);
+		free(control_path);
+		control_path = NULL;
+	}
+}
+
+/*
+ * Send one command to a running sntpd and print the reply, for -c.
+ * Returns 0 on OK, 1 on ERROR or failure.
+ */
+int control_client(const char *path, const char *cmd)
+{
+	struct sockaddr_un sa;
+	char buf[CONTROL_REPLY + 1];
+	size_t len = 0;
+	ssize_t num;
+	int sd, rc = 1;
+
+	if (sockaddr(&sa, path))
+		goto fail;
+
+	sd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (sd == -1)
+		goto fail;
+
+	if (connect(sd, (struct sockaddr *)&sa, sizeof(sa)) ||
+	    write(sd, cmd, strlen(cmd)) != (ssize_t)strlen(cmd) || write(sd, "\n", 1) != 1) {
+		close(sd);
+		goto fail;
+	}
+
+	/* Reply ends with a line OK or ERROR ... */
+	while (len < sizeof(buf) - 1) {
+		char *last;
+
+		num = read(sd, buf + len, sizeof(buf) - 1 - len);
+		if (num <= 0)
+			break;
+		len += num;
+		buf[len] = 0;
+
+		if (len < 1 || buf[len - 1] != '\n')
+			continue;
+		buf[len - 1] = 0;
+		last = strrchr(buf, '\n');
+		last = last ? last + 1 : buf;
+		buf[len - 1] = '\n';
+
+		if (!strcmp(last, "OK\n")) {
+			rc = 0;
+			break;
+		}
+		if (!strncmp(last, "ERROR", 5))
+			break;
+	}
+	close(sd);
+
+	fwrite(buf, len, 1, stdout);
+
+	return rc;
+fail:
+	fprintf(stderr, "%s: failed connecting to %s: %s\n", prognm, path, strerror(errno));
+	return 1;
+}
+
+/**
+ * Local Variables:
+ *  indent-tabs-mode: t
+ *  c-file-style: "linux"
+ * End:
+ */
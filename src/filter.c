@@ -0,0 +1,81 @@
+/* Clock filter for NTP client
+ *
+ * Copyright (C) 2010-2022  Joachim Wiberg <troglobit@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License (Version 2,
+ * June 1991) as published by the Free Software Foundation.  At the
+ * time of writing, that license was published by the FSF with the URL
+ * http://www.gnu.org/copyleft/gpl.html, and is incorporated herein by
+ * reference.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+/*
+ * A much simplified version of the RFC-5905 clock filter: of the last
+ * FILTER_SIZE samples the one with the lowest round-trip delay is the
+ * one least disturbed by queueing, so its offset is the best estimate.
+ * A sample is only ever used once, and never one older than the last
+ * used, otherwise the same offset is corrected for twice.
+ */
+
+#include "config.h"
+#include <math.h>
+#include "sntpd.h"
+
+void filter_reset(struct ntp_filter *f)
+{
+	memset(f, 0, sizeof(*f));
+}
+
+/*
+ * Add a sample, offset and delay in microseconds.  Returns 1 when a
+ * new filtered offset is available in f->offset, otherwise 0.
+ */
+int filter_add(struct ntp_filter *f, unsigned int absolute, double offset, double delay)
+{
+	double sum = 0.0;
+	int i, best;
+
+	f->sample[f->rp].absolute = absolute;
+	f->sample[f->rp].offset   = offset;
+	f->sample[f->rp].delay    = delay;
+	f->rp = (f->rp + 1) % FILTER_SIZE;
+	if (f->valid < FILTER_SIZE)
+		f->valid++;
+
+	best = 0;
+	for (i = 1; i < f->valid; i++) {
+		if (f->sample[i].delay < f->sample[best].delay)
+			best = i;
+	}
+
+	/* jitter: RMS of offset differences relative to the best sample */
+	for (i = 0; i < f->valid; i++) {
+		double diff = f->sample[i].offset - f->sample[best].offset;
+
+		sum += diff * diff;
+	}
+	if (f->valid > 1)
+		f->jitter = sqrt(sum / (f->valid - 1));
+
+	if (f->last && (int)(f->sample[best].absolute - f->last) <= 0)
+		return 0;
+
+	f->last   = f->sample[best].absolute;
+	f->offset = f->sample[best].offset;
+	f->delay  = f->sample[best].delay;
+
+	return 1;
+}
+
+/**
+ * Local Variables:
+ *  indent-tabs-mode: t
+ *  c-file-style: "linux"
+ * End:
+ */
@@ -1,14 +1,20 @@
 #include <errno.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdarg.h>		/* vsyslog(), vfprintf(), use -D_BSD_SOURCE */
 #include <string.h>
 #define SYSLOG_NAMES
 #include <syslog.h>
+#include <time.h>
 #include <sys/param.h>		/* MIN()/MAX() */
 
 #include "sntpd.h"
 
+const char *prognm = PACKAGE_NAME;
+
 struct {
 	const char *name;
 	int val;
@@ -29,6 +35,74 @@ struct {
 static int log_enable = 0;
 static int log_level = LOG_NOTICE;
 
+/*
+ * Asynchronous logging, see log_async().  Callers only store the format
+ * pointer and the raw arguments, copies of strings, in a lock-free ring
+ * of fixed size entries, a bounded MPSC queue with a sequence number per
+ * entry.  A thread formats and writes them.  When the ring is full the
+ * message is dropped and counted, the thread reports the count.
+ */
+#ifndef LOG_RING
+#define LOG_RING 256		/* entries, power of two */
+#endif
+#define LOG_ARGS 12
+#define LOG_STR  160		/* copies of %s arguments, or whole message */
+#define LOG_BUF  200		/* formatted message */
+
+enum { ARG_INT, ARG_UINT, ARG_CHAR, ARG_DBL, ARG_STR, ARG_PTR };
+
+union log_arg {
+	long long          i;
+	unsigned long long u;
+	double             d;
+	const void        *p;
+	int                off;		/* into str[], for %s */
+};
+
+struct log_entry {
+	unsigned int  seq;
+	int           severity;
+	int           syserr;
+	const char   *fmt;		/* NULL if str[] is the message */
+	union log_arg arg[LOG_ARGS];
+	char          str[LOG_STR];
+};
+
+static struct log_entry log_ring[LOG_RING];
+static unsigned int log_head;		/* producers */
+static unsigned int log_tail;		/* log thread */
+static unsigned int log_drops;
+static int log_stop;
+static sem_t log_sem;
+static pthread_t log_tid;
+static int log_running;
+
+/*
+ * Rate limiting, see log_ratelimit().  Each call site, told apart by its
+ * format string, has a token bucket: LIMIT_BURST messages at once, then
+ * one every LIMIT_RATE seconds.  Dropped messages are counted, the count
+ * is reported when the site is let through again, every LIMIT_SUMMARY
+ * seconds during a flood, or by log_summary().
+ */
+#define LIMIT_SLOTS   64		/* call sites, power of two */
+#define LIMIT_PROBE   4
+#define LIMIT_BURST   10		/* messages */
+#define LIMIT_RATE    6			/* sec per message, sustained */
+#define LIMIT_SUMMARY 60		/* sec */
+
+struct log_limit {
+	const char  *fmt;		/* NULL if free */
+	int          severity;
+	double       tokens;
+	double       last;		/* latest message, or refill */
+	double       since;		/* first suppressed, or last summary */
+	unsigned int suppressed;
+};
+
+static struct log_limit log_limits[LIMIT_SLOTS];
+static pthread_mutex_t log_limit_lock = PTHREAD_MUTEX_INITIALIZER;
+static int log_limiting;
+
 void log_init(int use_syslog, int level)
 {
 	log_enable = use_syslog;
@@ -41,12 +115,29 @@ void log_init(int use_syslog, int level)
 	setlogmask(LOG_UPTO(log_level));
 }
 
-void log_exit(void)
+/* Change log level at runtime, see control.c */
+void log_setlevel(int level)
 {
-	if (log_enable <= 0)
-		return;
+	log_level = level;
+	if (log_enable > 0)
+		setlogmask(LOG_UPTO(log_level));
+}
 
-	closelog();
+int log_getlevel(void)
+{
+	return log_level;
+}
+
+const char *log_lvl2str(int val)
+{
+	int i;
+
+	for (i = 0; prionm[i].name; i++) {
+		if (prionm[i].val == val)
+			return prionm[i].name;
+	}
+
+	return "unknown";
 }
 
 int log_str2lvl(char *arg)
@@ -63,18 +154,8 @@ int log_str2lvl(char *arg)
 	return atoi(arg);
 }
 
-void logit(int severity, int syserr, const char *format, ...)
+static void log_write(int severity, int syserr, const char *buf)
 {
-	va_list ap;
-	char buf[200];
-
-	if (log_level < severity)
-		return;
-
-	va_start(ap, format);
-	vsnprintf(buf, sizeof(buf), format, ap);
-	va_end(ap);
-
 	if (log_enable > 0) {
 		if (syserr)
 			syslog(severity, "%s: %s", buf, strerror(syserr));
@@ -90,11 +171,513 @@ void logit(int severity, int syserr, const char *format, ...)
 		fputs("ERROR - ", stderr);
 
 	if (syserr)
-		fprintf(stderr, "%s: %s\n", buf, strerror(errno));
+		fprintf(stderr, "%s: %s\n", buf, strerror(syserr));
 	else
 		fprintf(stderr, "%s\n", buf);
 }
 
+/*
+ * Parse one conversion at fmt, just after the '%'.  Returns its length,
+ * the argument type and the number of '*' in width and precision, or -1
+ * if it cannot be deferred, e.g. %n, %Lf or %ls.
+ */
+static int log_conv(const char *fmt, int *type, int *stars)
+{
+	const char *p = fmt;
+	int len = 0;
+
+	*stars = 0;
+	while (*p && strchr("-+ #0'", *p))
+		p++;
+	if (*p == '*') {
+		(*stars)++;
+		p++;
+	}
+	while (*p >= '0' && *p <= '9')
+		p++;
+	if (*p == '.') {
+		p++;
+		if (*p == '*') {
+			(*stars)++;
+			p++;
+		}
+		while (*p >= '0' && *p <= '9')
+			p++;
+	}
+	while (*p && strchr("hljzt", *p)) {
+		len++;
+		p++;
+	}
+
+	switch (*p) {
+	case 'd': case 'i':
+		*type = ARG_INT;
+		break;
+	case 'u': case 'o': case 'x': case 'X':
+		*type = ARG_UINT;
+		break;
+	case 'c':
+		*type = ARG_CHAR;
+		break;
+	case 'e': case 'E': case 'f': case 'F': case 'g': case 'G': case 'a': case 'A':
+		*type = ARG_DBL;
+		break;
+	case 's':
+		*type = ARG_STR;
+		break;
+	case 'p':
+		*type = ARG_PTR;
+		break;
+	default:
+		return -1;
+	}
+	if (len && *type != ARG_INT && *type != ARG_UINT)
+		return -1;
+
+	return p - fmt + 1;
+}
+
+/* Fetch an integer argument of the length given in the conversion */
+static void log_int(union log_arg *a, const char *conv, int len, int type, va_list *ap)
+{
+	const char *mod = conv + len - 1;
+	int l = 0, h = 0;
+
+	while (mod > conv && strchr("hljzt", mod[-1])) {
+		mod--;
+		if (*mod == 'l') l++;
+		else if (*mod == 'h') h++;
+		else l = *mod == 'j' ? 2 : 1;	/* 64-bit Linux, size_t etc. */
+	}
+
+	if (type == ARG_INT) {
+		if (l >= 2)      a->i = va_arg(*ap, long long);
+		else if (l)      a->i = va_arg(*ap, long);
+		else if (h >= 2) a->i = (signed char)va_arg(*ap, int);
+		else if (h)      a->i = (short)va_arg(*ap, int);
+		else             a->i = va_arg(*ap, int);
+	} else {
+		if (l >= 2)      a->u = va_arg(*ap, unsigned long long);
+		else if (l)      a->u = va_arg(*ap, unsigned long);
+		else if (h >= 2) a->u = (unsigned char)va_arg(*ap, unsigned int);
+		else if (h)      a->u = (unsigned short)va_arg(*ap, unsigned int);
+		else             a->u = va_arg(*ap, unsigned int);
+	}
+}
+
+/* Store the arguments of fmt in e, returns -1 if they do not fit */
+static int log_defer(struct log_entry *e, const char *fmt, va_list *ap)
+{
+	int num = 0, used = 0, type, stars, len;
+	const char *p;
+
+	for (p = fmt; (p = strchr(p, '%')); p += len + 1) {
+		if (p[1] == '%') {
+			len = 1;
+			continue;
+		}
+		len = log_conv(p + 1, &type, &stars);
+		if (len < 0 || num + stars + 1 > LOG_ARGS)
+			return -1;
+
+		while (stars--)
+			e->arg[num++].i = va_arg(*ap, int);
+
+		switch (type) {
+		case ARG_INT:
+		case ARG_UINT:
+			log_int(&e->arg[num], p + 1, len, type, ap);
+			break;
+		case ARG_CHAR:
+			e->arg[num].i = va_arg(*ap, int);
+			break;
+		case ARG_DBL:
+			e->arg[num].d = va_arg(*ap, double);
+			break;
+		case ARG_STR: {
+			const char *str = va_arg(*ap, const char *);
+			size_t n;
+
+			if (!str)
+				str = "(null)";
+			n = strlen(str);
+			if (used + n + 1 > LOG_STR)
+				return -1;
+			memcpy(&e->str[used], str, n + 1);
+			e->arg[num].off = used;
+			used += n + 1;
+			break;
+		}
+		case ARG_PTR:
+			e->arg[num].p = va_arg(*ap, void *);
+			break;
+		}
+		num++;
+	}
+	e->fmt = fmt;
+
+	return 0;
+}
+
+#define LOG_EMIT(val)							\
+	(stars == 2 ? snprintf(buf, len, spec, w[0], w[1], val) :	\
+	 stars == 1 ? snprintf(buf, len, spec, w[0], val) :		\
+		      snprintf(buf, len, spec, val))
+
+/* Format a deferred entry, in the log thread */
+static void log_format(struct log_entry *e, char *buf, size_t len)
+{
+	const char *fmt = e->fmt, *p;
+	int num = 0, type, stars, n, i;
+	char spec[32];
+
+	while (len > 1 && *fmt) {
+		p = strchr(fmt, '%');
+		if (!p)
+			p = fmt + strlen(fmt);
+
+		n = MIN((size_t)(p - fmt), len - 1);
+		memcpy(buf, fmt, n);
+		buf += n;
+		len -= n;
+		if (!*p)
+			break;
+
+		if (p[1] == '%') {
+			*buf++ = '%';
+			len--;
+			fmt = p + 2;
+			continue;
+		}
+
+		n = log_conv(p + 1, &type, &stars);
+		if (n < 0 || n + 4 > (int)sizeof(spec))
+			break;
+
+		/* integers are stored as long long, so is the spec */
+		if (type == ARG_INT || type == ARG_UINT) {
+			i = n;
+			while (strchr("hljzt", p[i - 1]))
+				i--;
+			memcpy(spec, p, i);
+			memcpy(&spec[i], "ll", 2);
+			spec[i + 2] = p[n];
+			spec[i + 3] = 0;
+		} else {
+			memcpy(spec, p, n + 1);
+			spec[n + 1] = 0;
+		}
+		fmt = p + n + 1;
+
+		{
+			int w[2] = { 0, 0 };
+			union log_arg *a;
+
+			for (i = 0; i < stars; i++)
+				w[i] = e->arg[num++].i;
+			a = &e->arg[num++];
+
+			switch (type) {
+			case ARG_INT:  n = LOG_EMIT(a->i);             break;
+			case ARG_UINT: n = LOG_EMIT(a->u);             break;
+			case ARG_CHAR: n = LOG_EMIT((int)a->i);        break;
+			case ARG_DBL:  n = LOG_EMIT(a->d);             break;
+			case ARG_STR:  n = LOG_EMIT(&e->str[a->off]);  break;
+			default:       n = LOG_EMIT(a->p);             break;
+			}
+		}
+		if (n < 0)
+			break;
+		if ((size_t)n >= len)
+			n = len - 1;
+		buf += n;
+		len -= n;
+	}
+	*buf = 0;
+}
+
+static void *log_thread(void *arg)
+{
+	char buf[LOG_BUF];
+	unsigned int drops;
+	struct log_entry *e;
+
+	(void)arg;
+	while (1) {
+		e = &log_ring[log_tail & (LOG_RING - 1)];
+		if (__atomic_load_n(&e->seq, __ATOMIC_ACQUIRE) == log_tail + 1) {
+			if (e->fmt)
+				log_format(e, buf, sizeof(buf));
+			else
+				memcpy(buf, e->str, sizeof(e->str));
+			log_write(e->severity, e->syserr, buf);
+			__atomic_store_n(&e->seq, log_tail + LOG_RING, __ATOMIC_RELEASE);
+			log_tail++;
+			continue;
+		}
+
+		drops = __atomic_exchange_n(&log_drops, 0, __ATOMIC_RELAXED);
+		if (drops) {
+			snprintf(buf, sizeof(buf), "Log ring full, dropped %u messages", drops);
+			log_write(LOG_WARNING, 0, buf);
+			continue;
+		}
+
+		if (__atomic_load_n(&log_stop, __ATOMIC_ACQUIRE))
+			break;
+		sem_wait(&log_sem);
+	}
+
+	return NULL;
+}
+
+/* Queue a message for the log thread, never blocks */
+static void log_queue(int severity, int syserr, const char *format, va_list ap)
+{
+	unsigned int pos, seq;
+	struct log_entry *e;
+	va_list aq;
+	int diff, rc;
+
+	pos = __atomic_load_n(&log_head, __ATOMIC_RELAXED);
+	while (1) {
+		e    = &log_ring[pos & (LOG_RING - 1)];
+		seq  = __atomic_load_n(&e->seq, __ATOMIC_ACQUIRE);
+		diff = (int)(seq - pos);
+		if (diff == 0) {
+			if (__atomic_compare_exchange_n(&log_head, &pos, pos + 1, 1,
+							__ATOMIC_RELAXED, __ATOMIC_RELAXED))
+				break;
+		} else if (diff < 0) {
+			__atomic_fetch_add(&log_drops, 1, __ATOMIC_RELAXED);
+			return;
+		} else {
+			pos = __atomic_load_n(&log_head, __ATOMIC_RELAXED);
+		}
+	}
+
+	e->severity = severity;
+	e->syserr   = syserr;
+	va_copy(aq, ap);
+	rc = log_defer(e, format, &aq);
+	va_end(aq);
+	if (rc) {
+		vsnprintf(e->str, sizeof(e->str), format, ap);
+		e->fmt = NULL;
+	}
+	__atomic_store_n(&e->seq, pos + 1, __ATOMIC_RELEASE);
+	sem_post(&log_sem);
+}
+
+/* Drain the ring and stop the log thread, also at exit() */
+static void log_sync(void)
+{
+	if (!log_running)
+		return;
+
+	__atomic_store_n(&log_stop, 1, __ATOMIC_RELEASE);
+	sem_post(&log_sem);
+	pthread_join(log_tid, NULL);
+	log_running = 0;
+}
+
+/*
+ * Move formatting and writing of log messages to a thread of its own,
+ * e.g. so a slow syslog daemon never delays the client.  Call after
+ * daemon(), threads do not survive fork().  Returns 0 on success, on
+ * error logging stays synchronous.
+ */
+int log_async(void)
+{
+	static int once;
+	sigset_t set, old;
+	unsigned int i;
+	int rc;
+
+	if (log_running)
+		return 0;
+
+	for (i = 0; i < LOG_RING; i++)
+		log_ring[i].seq = i;
+	log_head = log_tail = log_drops = 0;
+	log_stop = 0;
+	if (sem_init(&log_sem, 0, 0))
+		return -1;
+
+	/* All signals are handled by the client, in the main thread */
+	sigfillset(&set);
+	pthread_sigmask(SIG_SETMASK, &set, &old);
+	rc = pthread_create(&log_tid, NULL, log_thread, NULL);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	if (rc) {
+		sem_destroy(&log_sem);
+		ERR(rc, "Failed starting log thread");
+		return -1;
+	}
+	log_running = 1;
+
+	if (!once++)
+		atexit(log_sync);
+
+	return 0;
+}
+
+static double log_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Format and write, or queue, a message, bypasses the rate limit */
+static void log_emit(int severity, int syserr, const char *format, va_list ap)
+{
+	char buf[LOG_BUF];
+
+	if (log_running) {
+		log_queue(severity, syserr, format, ap);
+		return;
+	}
+	vsnprintf(buf, sizeof(buf), format, ap);
+	log_write(severity, syserr, buf);
+}
+
+static void log_print(int severity, const char *format, ...)
+{
+	va_list ap;
+
+	va_start(ap, format);
+	log_emit(severity, 0, format, ap);
+	va_end(ap);
+}
+
+/* Report and reset the count of a call site, call with the lock held */
+static void log_report(struct log_limit *l, double now)
+{
+	if (l->suppressed)
+		log_print(l->severity, "%u similar messages suppressed: \"%s\"",
+			  l->suppressed, l->fmt);
+	l->suppressed = 0;
+	l->since      = now;
+}
+
+/*
+ * Take a token from the bucket of the call site.  A site not seen before
+ * replaces a free slot or, when all are taken, the least recently used
+ * one in reach.  Returns 1 if the message should be dropped.
+ */
+static int log_limit(int severity, const char *format)
+{
+	struct log_limit *l = NULL, *victim = NULL;
+	double now = log_now();
+	unsigned int h, i;
+	int drop = 0;
+
+	h = (unsigned int)((uintptr_t)format >> 3) * 2654435761u;
+
+	pthread_mutex_lock(&log_limit_lock);
+	for (i = 0; i < LIMIT_PROBE; i++) {
+		struct log_limit *s = &log_limits[(h + i) & (LIMIT_SLOTS - 1)];
+
+		if (s->fmt == format) {
+			l = s;
+			break;
+		}
+		if (!victim || (victim->fmt && (!s->fmt || s->last < victim->last)))
+			victim = s;
+	}
+
+	if (!l) {
+		l = victim;
+		if (l->fmt)
+			log_report(l, now);
+		l->fmt        = format;
+		l->severity   = severity;
+		l->tokens     = LIMIT_BURST;
+		l->last       = now;
+		l->since      = now;
+		l->suppressed = 0;
+	}
+
+	l->tokens = MIN(LIMIT_BURST, l->tokens + (now - l->last) / LIMIT_RATE);
+	l->last   = now;
+	if (l->tokens >= 1) {
+		l->tokens -= 1;
+		if (l->suppressed)
+			log_report(l, now);
+	} else {
+		if (!l->suppressed++)
+			l->since = now;
+		else if (now - l->since >= LIMIT_SUMMARY)
+			log_report(l, now);
+		drop = 1;
+	}
+	pthread_mutex_unlock(&log_limit_lock);
+
+	return drop;
+}
+
+/* Report suppressed messages older than age seconds */
+static void log_flush(double age)
+{
+	double now = log_now();
+	int i;
+
+	pthread_mutex_lock(&log_limit_lock);
+	for (i = 0; i < LIMIT_SLOTS; i++) {
+		struct log_limit *l = &log_limits[i];
+
+		if (l->fmt && l->suppressed && now - l->since >= age)
+			log_report(l, now);
+	}
+	pthread_mutex_unlock(&log_limit_lock);
+}
+
+/*
+ * Limit the rate of messages per call site, except debug messages, so a
+ * flood of bad packets or failing retries cannot flood the log.  Used
+ * when running as a daemon, ntpclient and replay output is never lost.
+ */
+void log_ratelimit(int on)
+{
+	if (log_limiting && !on)
+		log_flush(0);
+	log_limiting = on;
+}
+
+/* Periodic summary of suppressed messages, called every poll */
+void log_summary(void)
+{
+	if (log_limiting)
+		log_flush(LIMIT_SUMMARY);
+}
+
+void log_exit(void)
+{
+	log_ratelimit(0);
+	log_sync();
+	if (log_enable <= 0)
+		return;
+
+	closelog();
+}
+
+void logit(int severity, int syserr, const char *format, ...)
+{
+	va_list ap;
+
+	if (log_level < severity)
+		return;
+	if (log_limiting && severity < LOG_DEBUG && log_limit(severity, format))
+		return;
+
+	va_start(ap, format);
+	log_emit(severity, syserr, format, ap);
+	va_end(ap);
+}
+
 /**
  * Local Variables:
  *  indent-tabs-mode: t
@@ -0,0 +1,464 @@
+/* OpenMetrics exporter
+ *
+ * Copyright (C) 2010-2022  Joachim Wiberg <troglobit@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License (Version 2,
+ * June 1991) as published by the Free Software Foundation.  At the
+ * time of writing, that license was published by the FSF with the URL
+ * http://www.gnu.org/copyleft/gpl.html, and is incorporated herein by
+ * reference.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+/*
+ * A minimal HTTP/1.0 endpoint, on a TCP port or a UNIX socket, serving
+ * the client and server state in OpenMetrics text format to scrapers,
+ * e.g. Prometheus.  It runs in a thread of its own.  The client keeps
+ * its state here also without the endpoint, for control.c, and with it
+ * publishes a snapshot after each poll and sample, the same seqlock as
+ * server.c, so a scrape only copies about a kilobyte and never holds up
+ * the client or the server.  Slow scrapers are cut off by socket
+ * timeouts.
+ */
+
+#include "config.h"
+#include <math.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <sys/un.h>
+#include <netdb.h>
+#include "sntpd.h"
+
+#define METRICS_TIMEOUT 1	/* sec, per scrape */
+#define METRICS_LINE    256	/* deviation line, with a full-length server label */
+#define METRICS_REPLY   (4096 + 3 * ALLAN_TAUS * METRICS_LINE)
+
+static struct {
+	unsigned int seq;
+	struct ntp_metrics m;
+} snapshot;
+
+static struct ntp_metrics cur;	/* client side, not shared */
+static struct allan dev;	/* ADEV, TDEV and MTIE of the offset */
+static pthread_t metrics_tid;
+static int metrics_running;
+static int metrics_sd = -1;
+static char *metrics_path;	/* UNIX socket, removed at exit */
+
+static void metrics_publish(void)
+{
+	unsigned int seq = __atomic_load_n(&snapshot.seq, __ATOMIC_RELAXED);
+
+	cur.holdover = peer.holdover;
+	if (metrics_sd == -1)
+		return;
+
+	__atomic_store_n(&snapshot.seq, seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	snapshot.m = cur;
+	__atomic_store_n(&snapshot.seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+static void metrics_read(struct ntp_metrics *m)
+{
+	unsigned int seq;
+
+	do {
+		seq = __atomic_load_n(&snapshot.seq, __ATOMIC_ACQUIRE);
+		*m = snapshot.m;
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	} while ((seq & 1) || seq != __atomic_load_n(&snapshot.seq, __ATOMIC_RELAXED));
+}
+
+/* Copy of the client state, for the client thread, see control.c */
+void metrics_get(struct ntp_metrics *m)
+{
+	cur.holdover = peer.holdover;
+	*m = cur;
+}
+
+/* Server name changed, or set at start */
+void metrics_server(const char *name)
+{
+	snprintf(cur.server, sizeof(cur.server), "%s", name ?: "");
+	allan_reset(&dev);
+	cur.num_dev = 0;
+	metrics_publish();
+}
+
+/* A poll was sent, shift the reachability register */
+void metrics_poll(int poll)
+{
+	/* Deviations at the old and new tau do not mix */
+	if (cur.poll && cur.poll != poll) {
+		allan_reset(&dev);
+		cur.num_dev = 0;
+	}
+
+	cur.reach = (cur.reach << 1) & 0xff;
+	cur.poll  = poll;
+	cur.polls++;
+	metrics_publish();
+}
+
+/* Holdover, no reply for a while, steering by the predicted frequency */
+void metrics_holdover(int freq)
+{
+	if (cur.holdover == peer.holdover && cur.freq == freq)
+		return;
+
+	cur.freq = freq;
+	metrics_publish();
+}
+
+/* A reply passed all checks, offset and delay in usec, root in sec */
+void metrics_sample(unsigned int absolute, double offset, double delay, int freq,
+		    double rootdelay, double rootdisp)
+{
+	double diff;
+
+	/* RMS of offset differences, as in RFC-5905 */
+	if (cur.samples) {
+		diff = offset - cur.offset;
+		cur.jitter = sqrt(cur.jitter * cur.jitter + (diff * diff - cur.jitter * cur.jitter) / 4);
+	}
+
+	cur.reach          |= 1;
+	cur.samples++;
+	cur.last            = absolute;
+	cur.offset          = offset;
+	cur.delay           = delay;
+	cur.freq            = freq;
+	cur.root_delay      = rootdelay;
+	cur.root_dispersion = rootdisp;
+
+	allan_add(&dev, absolute, offset);
+	cur.num_dev = allan_get(&dev, cur.dev, ALLAN_TAUS);
+	metrics_publish();
+}
+
+static void label(char *buf, size_t len, const char *str)
+{
+	size_t i = 0;
+
+	while (*str && i + 2 < len) {
+		if (*str == '"' || *str == '\\')
+			buf[i++] = '\\';
+		buf[i++] = *str++;
+	}
+	buf[i] = 0;
+}
+
+/*
+ * Formatted reply, never longer than len - 1.  Once a line does not fit
+ * nothing more is appended and the reply is marked truncated.
+ */
+struct reply {
+	char  *buf;
+	size_t len;
+	size_t n;
+	int    truncated;
+};
+
+static void append(struct reply *r, const char *fmt, ...)
+	__attribute__ ((format (printf, 2, 3)));
+
+static void append(struct reply *r, const char *fmt, ...)
+{
+	va_list ap;
+	int num;
+
+	if (r->truncated)
+		return;
+
+	va_start(ap, fmt);
+	num = vsnprintf(r->buf + r->n, r->len - r->n, fmt, ap);
+	va_end(ap);
+
+	if (num < 0 || (size_t)num >= r->len - r->n) {
+		r->buf[r->n] = 0;	/* drop the partial line */
+		r->truncated = 1;
+		return;
+	}
+	r->n += num;
+}
+
+#define GAUGE(name, help, fmt, val)					\
+	append(&r, "# TYPE sntpd_" name " gauge\n"			\
+		   "# HELP sntpd_" name " " help "\n"			\
+		   "sntpd_" name "{server=\"%s\"} " fmt "\n", id, val)
+#define COUNTER(name, help, val)					\
+	append(&r, "# TYPE sntpd_" name " counter\n"			\
+		   "# HELP sntpd_" name " " help "\n"			\
+		   "sntpd_" name "_total %llu\n", (unsigned long long)(val))
+#define BYTAU(name, help, fmt, field)					\
+	do {								\
+		append(&r, "# TYPE sntpd_" name " gauge\n"		\
+			   "# HELP sntpd_" name " " help "\n");	\
+		for (i = 0; i < m.num_dev; i++)				\
+			append(&r, "sntpd_" name "{server=\"%s\",tau=\"%.0f\"} " fmt "\n", \
+			       id, m.dev[i].tau, m.dev[i].field);	\
+	} while (0)
+
+/* Returns the length of the reply in buf, or 0 if it did not fit */
+static size_t metrics_format(char *buf, size_t len)
+{
+	struct reply r = { .buf = buf, .len = len };
+	struct server_stats ss;
+	struct ntp_metrics m;
+	char id[128];
+	int i;
+
+	metrics_read(&m);
+	server_stats(&ss);
+	label(id, sizeof(id), m.server);
+
+	GAUGE("offset_seconds", "Offset of the local clock to the server.", "%.9f", m.offset / 1e6);
+	GAUGE("delay_seconds", "Round-trip delay of the last sample.", "%.9f", m.delay / 1e6);
+	GAUGE("jitter_seconds", "RMS of offset differences.", "%.9f", m.jitter / 1e6);
+	GAUGE("frequency_ppm", "Frequency correction of the local clock.", "%.6f", m.freq / 65536.0);
+	GAUGE("poll_seconds", "Poll interval.", "%d", m.poll);
+	GAUGE("root_delay_seconds", "Root delay to the reference clock.", "%.9f", m.root_delay);
+	GAUGE("root_dispersion_seconds", "Root dispersion to the reference clock.", "%.9f", m.root_dispersion);
+	GAUGE("reach", "Reachability register, one bit per poll, last in LSB.", "%u", m.reach);
+	GAUGE("up", "Server answered the last poll.", "%u", m.reach & 1);
+	GAUGE("last_sample_timestamp_seconds", "Time of the last sample, UNIX epoch.", "%lld",
+	      m.last ? (long long)m.last - JAN_1970 : 0LL);
+	GAUGE("holdover", "Steering by predicted frequency, server gone.", "%d", m.holdover);
+	BYTAU("allan_deviation", "Allan deviation of the offset, by tau in seconds.", "%.6g", adev);
+	BYTAU("time_deviation_seconds", "Time deviation, TDEV, of the offset, by tau in seconds.", "%.6g", tdev / 1e6);
+	BYTAU("mtie_seconds", "Maximum time interval error of the offset, by tau in seconds.", "%.6g", mtie / 1e6);
+	COUNTER("polls", "Polls sent.", m.polls);
+	COUNTER("samples", "Replies used.", m.samples);
+	COUNTER("server_requests", "Requests to the server.", ss.requests);
+	COUNTER("server_replies", "Replies sent by the server.", ss.replies);
+	COUNTER("server_drops", "Requests dropped by the server, invalid or failed to send.", ss.drops);
+	append(&r, "# EOF\n");
+
+	if (r.truncated) {
+		ERR(0, "Metrics reply does not fit in %zu bytes", len);
+		return 0;
+	}
+
+	return r.n;
+}
+
+static int writeall(int sd, const char *buf, size_t len)
+{
+	ssize_t num;
+
+	while (len > 0) {
+		num = write(sd, buf, len);
+		if (num <= 0)
+			return -1;
+		buf += num;
+		len -= num;
+	}
+
+	return 0;
+}
+
+static void metrics_serve(int sd)
+{
+	struct timeval tv = { .tv_sec = METRICS_TIMEOUT };
+	char req[512], hdr[256], buf[METRICS_REPLY];
+	const char *status = "200 OK";
+	size_t len = 0;
+	ssize_t num;
+
+	setsockopt(sd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	setsockopt(sd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+
+	/* Only the request line matters, the rest is ignored */
+	num = read(sd, req, sizeof(req) - 1);
+	if (num <= 0)
+		return;
+	req[num] = 0;
+
+	if (strncmp(req, "GET ", 4))
+		status = "405 Method Not Allowed";
+	else if (strncmp(req + 4, "/ ", 2) && strncmp(req + 4, "/metrics", 8))
+		status = "404 Not Found";
+	else if (!(len = metrics_format(buf, sizeof(buf))))
+		status = "500 Internal Server Error";
+
+	num = snprintf(hdr, sizeof(hdr), "HTTP/1.0 %s\r\n"
+		       "Content-Type: application/openmetrics-text; version=1.0.0; charset=utf-8\r\n"
+		       "Content-Length: %zu\r\n\r\n", status, len);
+	if (!writeall(sd, hdr, num))
+		writeall(sd, buf, len);
+}
+
+static void *metrics_thread(void *arg)
+{
+	int sd;
+
+	(void)arg;
+	pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+	while (1) {
+		/* Only allow metrics_exit() to cancel us while waiting */
+		pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+		sd = accept(metrics_sd, NULL, NULL);
+		pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+		if (sd == -1)
+			continue;
+
+		metrics_serve(sd);
+		close(sd);
+	}
+
+	return NULL;
+}
+
+static int metrics_unix(const char *path)
+{
+	struct sockaddr_un sa;
+	int sd;
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sun_family = AF_UNIX;
+	if (strlen(path) >= sizeof(sa.sun_path)) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	strcpy(sa.sun_path, path);
+
+	sd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (sd == -1)
+		return -1;
+
+	unlink(path);
+	if (bind(sd, (struct sockaddr *)&sa, sizeof(sa))) {
+		close(sd);
+		return -1;
+	}
+	metrics_path = strdup(path);
+
+	return sd;
+}
+
+/* [ADDR:]PORT, default ADDR is localhost, [ADDR]:PORT for IPv6 */
+static int metrics_inet(char *spec)
+{
+	struct addrinfo hints, *ai;
+	const char *addr = "localhost";
+	char *port = spec, *ptr;
+	int sd, on = 1, rc;
+
+	ptr = strrchr(spec, ':');
+	if (ptr) {
+		*ptr++ = 0;
+		port = ptr;
+		addr = spec;
+		if (*spec == '[') {
+			addr = ++spec;
+			ptr = strchr(spec, ']');
+			if (ptr)
+				*ptr = 0;
+		}
+	}
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family   = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags    = AI_PASSIVE;
+	rc = getaddrinfo(addr, port, &hints, &ai);
+	if (rc) {
+		ERR(0, "Failed resolving metrics address %s:%s: %s", addr, port, gai_strerror(rc));
+		errno = EINVAL;
+		return -1;
+	}
+
+	sd = socket(ai->ai_family, ai->ai_socktype | SOCK_CLOEXEC, 0);
+	if (sd == -1)
+		goto fail;
+
+	setsockopt(sd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+	if (bind(sd, ai->ai_addr, ai->ai_addrlen)) {
+		close(sd);
+		sd = -1;
+	}
+fail:
+	freeaddrinfo(ai);
+
+	return sd;
+}
+
+/*
+ * Start metrics endpoint, spec is a path to a UNIX socket, or a TCP
+ * [ADDR:]PORT, by default on localhost.  Returns 0 on success.
+ */
+int metrics_init(const char *spec)
+{
+	sigset_t set, old;
+	char *buf;
+	int rc;
+
+	buf = strdup(spec);
+	if (!buf)
+		return -1;
+
+	if (strchr(buf, '/'))
+		metrics_sd = metrics_unix(buf);
+	else
+		metrics_sd = metrics_inet(buf);
+	free(buf);
+	if (metrics_sd == -1)
+		goto fail;
+
+	if (listen(metrics_sd, 8))
+		goto fail;
+
+	metrics_publish();
+
+	/* All signals are handled by the client, in the main thread */
+	sigfillset(&set);
+	pthread_sigmask(SIG_SETMASK, &set, &old);
+	rc = pthread_create(&metrics_tid, NULL, metrics_thread, NULL);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	if (rc) {
+		errno = rc;
+		goto fail;
+	}
+	metrics_running = 1;
+
+	return 0;
+fail:
+	ERR(errno, "Failed starting metrics endpoint %s", spec);
+	metrics_exit();
+
+	return -1;
+}
+
+void metrics_exit(void)
+{
+	if (metrics_sd == -1)
+		return;
+
+	if (metrics_running) {
+		pthread_cancel(metrics_tid);
+		pthread_join(metrics_tid, NULL);
+		metrics_running = 0;
+	}
+	close(metrics_sd);
+	metrics_sd = -1;
+
+	if (metrics_path) {
+		unlink(metrics_path);
+		free(metrics_path);
+		metrics_path = NULL;
+	}
+}
+
+/**
+ * Local Variables:
+ *  indent-tabs-mode: t
+ *  c-file-style: "linux"
+ * End:
+ */
@@ -0,0 +1,148 @@
+/* Network readiness, wait for addresses and routes with rtnetlink
+ *
+ * Copyright (C) 2010-2022  Joachim Wiberg <troglobit@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License (Version 2,
+ * June 1991) as published by the Free Software Foundation.  At the
+ * time of writing, that license was published by the FSF with the URL
+ * http://www.gnu.org/copyleft/gpl.html, and is incorporated herein by
+ * reference.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+/*
+ * While the server cannot be resolved or reached, loop() waits on this
+ * socket, subscribed to link, address and route changes, and retries as
+ * soon as an interface comes up or an address or route is added.  The
+ * socket is only open while the network is down.  Without rtnetlink,
+ * netlink_open() fails and loop() falls back to its backoff timer.
+ */
+
+#include "config.h"
+#include "sntpd.h"
+
+#ifdef HAVE_LINUX_RTNETLINK_H
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+#include <net/if.h>
+
+#define NETLINK_GROUPS (RTMGRP_LINK | RTMGRP_IPV4_IFADDR | RTMGRP_IPV6_IFADDR | \
+			RTMGRP_IPV4_ROUTE | RTMGRP_IPV6_ROUTE)
+
+/* Returns a non-blocking socket, or -1 on error */
+int netlink_open(void)
+{
+	struct sockaddr_nl sa;
+	int sd;
+
+	sd = socket(AF_NETLINK, SOCK_RAW | SOCK_NONBLOCK | SOCK_CLOEXEC, NETLINK_ROUTE);
+	if (sd == -1)
+		goto fail;
+
+	memset(&sa, 0, sizeof(sa));
+	sa.nl_family = AF_NETLINK;
+	sa.nl_groups = NETLINK_GROUPS;
+	if (bind(sd, (struct sockaddr *)&sa, sizeof(sa))) {
+		close(sd);
+		goto fail;
+	}
+
+	return sd;
+fail:
+	DBG("Failed opening rtnetlink socket: %s", strerror(errno));
+	return -1;
+}
+
+/* New address or route, or an interface that is up and running */
+static int usable(const struct nlmsghdr *nh)
+{
+	const struct ifinfomsg *ifi;
+	const struct rtmsg *rtm;
+
+	switch (nh->nlmsg_type) {
+	case RTM_NEWADDR:
+		return 1;
+
+	case RTM_NEWROUTE:
+		if (nh->nlmsg_len < NLMSG_LENGTH(sizeof(*rtm)))
+			return 0;
+		rtm = NLMSG_DATA(nh);
+		return rtm->rtm_table == RT_TABLE_MAIN && rtm->rtm_type == RTN_UNICAST;
+
+	case RTM_NEWLINK:
+		if (nh->nlmsg_len < NLMSG_LENGTH(sizeof(*ifi)))
+			return 0;
+		ifi = NLMSG_DATA(nh);
+		return (ifi->ifi_flags & (IFF_UP | IFF_RUNNING)) == (IFF_UP | IFF_RUNNING);
+	}
+
+	return 0;
+}
+
+/*
+ * Read all pending messages, call when sd is readable.  Returns 1 if the
+ * network may have become usable, also when messages were lost, else 0.
+ */
+int netlink_event(int sd)
+{
+	uint32_t buf[2048];
+	int ready = 0;
+
+	while (1) {
+		struct nlmsghdr *nh;
+		ssize_t len;
+
+		len = recv(sd, buf, sizeof(buf), 0);
+		if (len == -1) {
+			if (errno == EINTR)
+				continue;
+			if (errno == ENOBUFS)
+				ready = 1;	/* overrun, lost events */
+			break;
+		}
+
+		for (nh = (struct nlmsghdr *)buf; NLMSG_OK(nh, len); nh = NLMSG_NEXT(nh, len)) {
+			if (usable(nh))
+				ready = 1;
+		}
+	}
+
+	return ready;
+}
+
+void netlink_close(int sd)
+{
+	if (sd != -1)
+		close(sd);
+}
+
+#else /* !HAVE_LINUX_RTNETLINK_H */
+
+int netlink_open(void)
+{
+	errno = ENOSYS;
+	return -1;
+}
+
+int netlink_event(int sd)
+{
+	return 0;
+}
+
+void netlink_close(int sd)
+{
+}
+
+#endif
+
+/**
+ * Local Variables:
+ *  indent-tabs-mode: t
+ *  c-file-style: "linux"
+ * End:
+ */
@@ -0,0 +1,171 @@
+/* NTP packet encode, decode and sanity checks
+ *
+ * Copyright (C) 1997-2015  Larry Doolittle <larry@doolittle.boa.org>
+ * Copyright (C) 2010-2022  Joachim Wiberg <troglobit@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License (Version 2,
+ * June 1991) as published by the Free Software Foundation.  At the
+ * time of writing, that license was published by the FSF with the URL
+ * http://www.gnu.org/copyleft/gpl.html, and is incorporated herein by
+ * reference.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+/*
+ * The client side of the protocol, without sockets or state, shared by
+ * sntpd and libsntp, see sntp.c.
+ */
+
+#include "config.h"
+#include <time.h>
+#ifdef PRECISION_SIOCGSTAMP
+#include <sys/ioctl.h>
+#endif
+
+#include "sntpd.h"
+
+void ntpc_gettime(struct ntptime *nt)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_REALTIME, &now);
+	nt->coarse = now.tv_sec + JAN_1970;
+	nt->fine   = NTPFRAC(now.tv_nsec / 1000);
+}
+
+void get_packet_timestamp(int usd, struct ntptime *udp_arrival_ntp)
+{
+#ifdef PRECISION_SIOCGSTAMP
+	struct timeval udp_arrival;
+
+	if (ioctl(usd, SIOCGSTAMP, &udp_arrival) < 0) {
+		ERR(errno, "Failed ioctl(SIOCGSTAMP)");
+		ntpc_gettime(udp_arrival_ntp);
+	} else {
+		udp_arrival_ntp->coarse = udp_arrival.tv_sec + JAN_1970;
+		udp_arrival_ntp->fine = NTPFRAC(udp_arrival.tv_usec);
+	}
+#else
+	(void)usd;		/* not used */
+	ntpc_gettime(udp_arrival_ntp);
+#endif
+}
+
+/* Client request, stamped with the time of sending, in time_sent */
+void ntp_request(uint32_t data[12], struct ntptime *time_sent)
+{
+#define LI 0
+#define VN 3
+#define MODE 3
+#define STRATUM 0
+#define POLL 4
+#define PREC -6
+
+	memset(data, 0, 48);
+	data[0] = htonl((LI << 30) | (VN << 27) | (MODE << 24) | (STRATUM << 16) | (POLL << 8) | (PREC & 0xff));
+	data[1] = htonl(1 << 16);	/* Root Delay (seconds) */
+	data[2] = htonl(1 << 16);	/* Root Dispersion (seconds) */
+	ntpc_gettime(time_sent);
+
+	data[10] = htonl(time_sent->coarse);	/* Transmit Timestamp coarse */
+	data[11] = htonl(time_sent->fine);	/* Transmit Timestamp fine   */
+}
+
+static double ntpdiff(struct ntptime *start, struct ntptime *stop)
+{
+	int a;
+	unsigned int b;
+
+	a = stop->coarse - start->coarse;
+	if (stop->fine >= start->fine) {
+		b = stop->fine - start->fine;
+	} else {
+		b = start->fine - stop->fine;
+		b = ~b;
+		a -= 1;
+	}
+
+	return a * 1.e6 + b * (1.e6 / 4294967296.0);
+}
+
+/* Decode a reply, straight out of RFC-1305 Appendix A, arrival is T4 */
+void ntp_decode(const uint32_t *data, const struct ntptime *arrival, struct ntp_reply *r)
+{
+	struct ntptimes pkt_root_delay, pkt_root_dispersion;
+	struct ntptime t4 = *arrival;
+	double skew1, skew2;
+
+#define Data(i) ntohl(((const uint32_t *)data)[i])
+	r->li      = Data(0) >> 30 & 0x03;
+	r->vn      = Data(0) >> 27 & 0x07;
+	r->mode    = Data(0) >> 24 & 0x07;
+	r->stratum = Data(0) >> 16 & 0xff;
+	r->poll    = Data(0) >>  8 & 0xff;
+	r->prec    = Data(0) & 0xff;
+	if (r->prec & 0x80)
+		r->prec |= 0xffffff00;
+	r->delay   = Data(1);
+	r->disp    = Data(2);
+	r->refid   = Data(3);
+
+	r->reftime.coarse = Data(4);
+	r->reftime.fine   = Data(5);
+	r->orgtime.coarse = Data(6);
+	r->orgtime.fine   = Data(7);
+	r->rectime.coarse = Data(8);
+	r->rectime.fine   = Data(9);
+	r->xmttime.coarse = Data(10);
+	r->xmttime.fine   = Data(11);
+#undef Data
+
+	r->el_time = ntpdiff(&r->orgtime, &t4);		/* elapsed: (T4 - T1)*/
+	r->st_time = ntpdiff(&r->rectime, &r->xmttime);	/* stall: (T3 - T2) */
+	skew1 = ntpdiff(&r->orgtime, &r->rectime);
+	skew2 = ntpdiff(&r->xmttime, &t4);
+	r->offset = (skew1 - skew2) / 2;
+
+	pkt_root_delay.coarse = ((uint32_t)r->delay >> 16) & 0xFFFF;
+	pkt_root_delay.fine   = ((uint32_t)r->delay >>  0) & 0xFFFF;
+	pkt_root_dispersion.coarse = ((uint32_t)r->disp >> 16) & 0xFFFF;
+	pkt_root_dispersion.fine   = ((uint32_t)r->disp >>  0) & 0xFFFF;
+	r->root_delay      = wire2d32(&pkt_root_delay);
+	r->root_dispersion = wire2d32(&pkt_root_dispersion);
+}
+
+/*
+ * Error checking, see RFC-4330 section 5, sent is the transmit time of
+ * our request.  Returns NULL if the reply is sane, or the reason not.
+ */
+const char *ntp_check(const struct ntp_reply *r, const struct ntptime *sent)
+{
+	if (r->li == 3)
+		return "LI==3";	/* unsynchronized */
+	if (r->vn < 3)
+		return "VN<3";	/* RFC-4330 documents SNTP v4, but we interoperate with NTP v3 */
+	if (r->mode != 4)
+		return "MODE!=3";
+	if (r->orgtime.coarse != sent->coarse || r->orgtime.fine != sent->fine)
+		return "ORG!=sent";
+	if (r->xmttime.coarse == 0 && r->xmttime.fine == 0)
+		return "XMT==0";
+	if (r->delay > 65536 || r->delay < -65536)
+		return "abs(DELAY)>65536";
+	if (r->disp > 65536 || r->disp < -65536)
+		return "abs(DISP)>65536";
+	if (r->stratum == 0)
+		return "STRATUM==0";	/* kiss o' death */
+
+	return NULL;
+}
+
+/**
+ * Local Variables:
+ *  indent-tabs-mode: t
+ *  c-file-style: "linux"
+ * End:
+ */
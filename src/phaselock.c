@@ -16,43 +16,210 @@
  */
 
 /*
+ * Two engines, selected per instance with -T engine=NAME:
+ *
+ *  polygon  the original, finds the envelope of all lines through the
+ *           last window samples' error bars, and from that the smallest
+ *           frequency change consistent with all of them.  Makes no
+ *           assumption on the noise, but needs a full ring to start.
+ *  kalman   a two-state, phase and frequency, Kalman filter with the
+ *           noise estimated from the sample stream.  Locks in a few
+ *           polls when the jitter is close to Gaussian.  Always uses
+ *           double, also in the fixed point build.
+ *
  * Possible future improvements:
- *  - Subtract configurable amount from errorbar
- *  - Build in general run-time access to tune parameters
  *  - Sculpt code so it's legible, this version is out of control
  */
 
+#include <math.h>
+#include <stddef.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include "sntpd.h"
 
-double min_delay = 800.0;  /* global, user-changeable, units are microseconds */
+/* Parameters for new instances, user-changeable with -q and -T */
+struct phaselock_param phaselock_defaults = {
+	.engine      = PHASELOCK_POLYGON,
+	.window      = RING_SIZE,
+	.min_delay   = 800.0,	/* usec, subtracted from errorbar */
+	.max_correct = 250.0,	/* ppm change to system clock */
+	.min_init    = 20.0,	/* ppm, largest change per sample */
+	.shift_fast  = 600.0,
+	.shift_slow  = 6000.0,
+	.shift_bias  = 0.3,
+	.crit_time   = 1000.0,
+	.center_fast = 600.0,
+	.center_slow = 1800.0,
+	.kalman_tau  = 1800.0,	/* sec, phase correction */
+};
+
+static const char *engine_name[] = { "polygon", "kalman" };
+#define NUM_ENGINE (int)(sizeof(engine_name) / sizeof(engine_name[0]))
 
-#define RING_SIZE 16
-#define MAX_CORRECT 250   /* ppm change to system clock */
-#define MAX_C ((MAX_CORRECT)*65536)
-static struct datum {
+/* Largest window, the envelopes are rebuilt from all of it every sample */
+#define WINDOW_MAX 1024
+
+/*
+ * Names for phaselock_tune() and phaselock_spec().  Time constants and
+ * limits are divisors, or make no sense, unless positive.  No value may
+ * overflow the fixed point build.
+ */
+#define PARAM(name, pos) { #name, offsetof(struct phaselock_param, name), pos }
+#define PARAM_MAX 1e9
+static const struct {
+	const char *name;
+	size_t offset;
+	int positive;
+} param_list[] = {
+	PARAM(min_delay,   0),
+	PARAM(max_correct, 1),
+	PARAM(min_init,    1),
+	PARAM(shift_fast,  1),
+	PARAM(shift_slow,  1),
+	PARAM(shift_bias,  0),
+	PARAM(crit_time,   1),
+	PARAM(center_fast, 1),
+	PARAM(center_slow, 1),
+	PARAM(kalman_tau,  1),
+};
+#define NUM_PARAM (int)(sizeof(param_list) / sizeof(param_list[0]))
+#define PARAM_VAL(p, i) ((double *)((char *)(p) + param_list[i].offset))
+
+/*
+ * Arithmetic of the phase lock, double by default.  The fixed point
+ * build, --enable-fixed-point, is for targets without FPU: offsets in
+ * usec and slopes in ppm are then Q16.16 in a 64-bit integer, which
+ * has room for a million seconds times the offsets at hand.  Time
+ * differences are integer seconds in both builds, and frequencies are
+ * already ppm * 65536.  Conversion to and from double is only done at
+ * the API, in phaselock_feed(), and for parameters, debug and state.
+ */
+#ifdef ENABLE_FIXED_POINT
+typedef int64_t real;
+#define REAL(x)       ((real)((x) * 65536.0 + ((x) < 0 ? -0.5 : 0.5)))
+#define DBL(x)        ((double)(x) / 65536.0)
+#define MUL(a, b)     (((a) * (b)) / 65536)
+#define DIV(a, b)     (((a) * 65536) / (b))
+#define HALF(a)       ((a) / 2)
+#define FREQ_SCALE    1		/* freq to real ppm */
+#define FREQ(x)       ((int)(x))
+#else
+typedef double real;
+#define REAL(x)       (x)
+#define DBL(x)        (x)
+#define MUL(a, b)     ((a) * (b))
+#define DIV(a, b)     ((a) / (b))
+#define HALF(a)       (0.5 * (a))
+#define FREQ_SCALE    65536
+#define FREQ(x)       ((int)((x) * 65536 + .5))
+#endif
+
+struct datum {
 	unsigned int absolute;
-	double skew;
-	double errorbar;
+	real skew;
+	real errorbar;
 	int freq;
 	/* s.s.min and s.s.max (skews) are "corrected" to what they would
 	 * have been if freq had been constant at its current value during
 	 * the measurements.
 	 */
 	union {
-		struct { double min; double max; } s;
-		double ss[2];
+		struct { real min; real max; } s;
+		real ss[2];
 	} s;
 	/*
 	double smin;
 	double smax;
 	 */
-} d_ring[RING_SIZE];
+};
+
+struct _seg {
+	real slope;
+	real offset;
+};
+
+/* Pseudo-class for finding consistent frequency shift */
+struct _polygon {
+	real l_min;
+	real r_min;
+};
+
+/* State of the kalman engine */
+struct kalman {
+	int    init;
+	unsigned int last;		/* time of last sample */
+	int    freq;			/* kernel freq at last sample */
+	double x[2];			/* skew, usec, and its rate, ppm */
+	double p[2][2];			/* covariance of x */
+	double r;			/* measurement noise, usec^2 */
+	double q;			/* frequency random walk, ppm^2/sec */
+	double min_err;			/* smallest recent errorbar, usec */
+	int    spikes;			/* consecutive outliers */
+	int    num;			/* number of samples in r */
+	struct {
+		double t, z, d;		/* time, skew, excess delay */
+	} h[2];				/* last two accepted, h[1] newest */
+};
 
-static struct _seg {
-	double slope;
-	double offset;
-} maxseg[RING_SIZE+1], minseg[RING_SIZE+1];
+/*
+ * Frequency history, see history_add().  The finest tier, raw samples
+ * over the last minutes, is d_ring itself, window samples at the poll
+ * interval.  Above it are min/max/mean buckets per hour and per day.
+ */
+#define HIST_HOURS 48
+#define HIST_DAYS  32
+
+struct bucket {
+	unsigned int start;		/* time of first sample */
+	int    num;
+	int    min, max;		/* freq */
+	double sum;
+};
+
+struct history {
+	struct bucket hour[HIST_HOURS];
+	struct bucket day[HIST_DAYS];
+	int    h, d;			/* current hour and day */
+	unsigned int last_t;		/* time of last sample */
+	int    last;			/* freq, last sample */
+
+	int    hours;			/* completed hours in predictor */
+	unsigned int t;			/* time of level */
+	double level;			/* freq */
+	double trend;			/* freq per sec */
+	double season[24];		/* freq, by hour of day */
+	double err[3];			/* hold, trend, season, see history_skill() */
+};
+
+/*
+ * All state of one phase lock instance, so several can run side by
+ * side, e.g. one per upstream server, or replays in parallel threads.
+ * The arrays are sized by the window, number of samples in the ring,
+ * and live in the same memory block as the struct itself.
+ */
+struct phaselock {
+	struct phaselock_param param;
+	struct {
+		real min_delay, max_correct, min_init;
+		real shift_fast, shift_slow, shift_bias;
+		real crit_time, center_fast, center_slow;
+		int  max_c;		/* max_correct in freq units */
+	} k;				/* param, in our arithmetic */
+	int window;
+	int rp, valid;
+	struct _polygon df;
+	struct kalman kf;
+	struct history hist;
+
+	struct datum *d_ring;		/* [window] */
+	struct _seg *maxseg, *minseg;	/* [window + 1] */
+	struct _seg *cross;		/* [window], scratch */
+	int *hull, *stack;		/* [window], scratch */
+
+	phaselock_trace_fn *trace_fn;	/* subscriber, see phaselock_subscribe() */
+	void *trace_arg;
+	struct phaselock_line *line;	/* [2 * window], trace of envelopes */
+};
 
 #if 0
 /* draw a line from a to c, what the offset is of that line
@@ -67,68 +234,137 @@ static double interpolate(struct _seg *a, struct _seg *b, struct _seg *c)
 }
 #endif
 
-static int next_up(int i) { int r = i+1; if (r>=RING_SIZE) r=0; return r;}
-static int next_dn(int i) { int r = i-1; if (r<0) r=RING_SIZE-1; return r;}
+static int next_up(struct phaselock *pl, int i) { int r = i+1; if (r>=pl->window) r=0; return r;}
+static int next_dn(struct phaselock *pl, int i) { int r = i-1; if (r<0) r=pl->window-1; return r;}
 
-/* Looks at the line segments that start at point j, that end at
- * all following points (ending at index rp).  The initial point
- * is on curve s0, the ending point is on curve s1.  The curve choice
- * (s.min vs. s.max) is based on the index in ss[].  The scan
- * looks for the largest (sign=0) or smallest (sign=1) slope.
+/* Ring index of the k:th oldest point, 0 is the oldest, window-1 is rp */
+static int age(struct phaselock *pl, int k) { return (pl->rp + 1 + k) % pl->window; }
+
+/* Slope of the line from point j on curve s1 to point n on curve s0 */
+static real slope(struct phaselock *pl, int j, int s1, int n, int s0)
+{
+	long dt = pl->d_ring[n].absolute - pl->d_ring[j].absolute;
+
+	return (pl->d_ring[n].s.ss[s0] - pl->d_ring[j].s.ss[s1]) / dt;
+}
+
+/* The line from point j on curve s1 to point n on curve s0, with its
+ * offset at the time of the newest point, rp.
  */
-static int search(int rp, int j, int s0, int s1, int sign, struct _seg *answer)
+static void segment(struct phaselock *pl, int j, int s1, int n, int s0, struct _seg *answer)
 {
-	double dt, slope;
-	int n, nextj = 0, cinit = 1;
+	answer->slope  = slope(pl, j, s1, n, s0);
+	answer->offset = pl->d_ring[n].s.ss[s0] +
+		answer->slope*(long)(pl->d_ring[pl->rp].absolute - pl->d_ring[n].absolute);
+}
 
-	for (n = next_up(j); n != next_up(rp); n = next_up(n)) {
-#ifdef ENABLE_DEBUG
-		DBG("d_ring[%d].s.ss[%d]=%f d_ring[%d].s.ss[%d]=%f",
-		    n, s0, d_ring[n].s.ss[s0], j, s1, d_ring[j].s.ss[s1]);
-#endif
-		dt = d_ring[n].absolute - d_ring[j].absolute;
-		slope = (d_ring[n].s.ss[s0] - d_ring[j].s.ss[s1]) / dt;
-#ifdef ENABLE_DEBUG
-		DBG("slope %d%d%d [%d,%d] = %f", s0, s1, sign, j, n, slope);
-#endif
-		if (cinit || (slope < answer->slope) ^ sign) {
-			answer->slope = slope;
-			answer->offset = d_ring[n].s.ss[s0] +
-				slope*(d_ring[rp].absolute - d_ring[n].absolute);
-			cinit = 0;
-			nextj = n;
-		}
+/* Is point b above (upper=1) or below (upper=0) the line from a to c,
+ * on curve s?  Points are in time order a, b, c.
+ */
+static int outside(struct phaselock *pl, int a, int b, int c, int s, int upper)
+{
+	real lhs = (pl->d_ring[b].s.ss[s] - pl->d_ring[a].s.ss[s]) *
+		(real)(pl->d_ring[c].absolute - pl->d_ring[a].absolute);
+	real rhs = (pl->d_ring[c].s.ss[s] - pl->d_ring[a].s.ss[s]) *
+		(real)(pl->d_ring[b].absolute - pl->d_ring[a].absolute);
+
+	return upper ? lhs > rhs : lhs < rhs;
+}
+
+/* Finds the envelope of curve s, a monotone chain of points from the
+ * oldest to the newest where each line segment has the largest (sign=1)
+ * or smallest (sign=0) slope from its starting point to any following
+ * point.  Ties are resolved to the nearest point for the smallest slope
+ * and the farthest point for the largest slope.  The chain is built in
+ * one pass over the ring, O(n), since each point is pushed and popped
+ * at most once.  Returns the number of points in hull[].
+ *
+ * The chain, and the crossings below, are rebuilt for every sample, not
+ * updated as points enter and leave the window.  Dropping the oldest
+ * point can bring back any of the points it hid, so an incremental hull
+ * must keep them all and is no cheaper in the worst case.  At the
+ * default window of 16 a rebuild is a few hundred operations per poll.
+ */
+static int envelope(struct phaselock *pl, int s, int sign)
+{
+	int k, c, num = 0;
+
+	for (k = 0; k < pl->window; k++) {
+		c = age(pl, k);
+		while (num >= 2 && outside(pl, pl->hull[num-2], pl->hull[num-1], c, s, 1) ^ sign)
+			num--;
+		pl->hull[num++] = c;
 	}
-	return nextj;
+
+	return num;
 }
 
-/* Pseudo-class for finding consistent frequency shift */
-#define MIN_INIT 20
-static struct _polygon {
-	double l_min;
-	double r_min;
-} df;
+/* For the num points j in hull[] on curve s1, finds the line to any
+ * following point on curve s0 with the largest (sign=1) or smallest
+ * (sign=0) slope, ties resolved like envelope().  Scanning from the
+ * newest point backwards, the convex hull (upper for sign=1, lower for
+ * sign=0) of the following points is kept in stack[].  The wanted line
+ * touches that hull and is found with a binary search, so this is O(n)
+ * plus O(log n) per hull point.  Results are stored in cross[], indexed
+ * by ring index.
+ */
+static void crossing(struct phaselock *pl, int s0, int s1, int sign, int num)
+{
+	int k, j, v, top = 0;
+
+	for (k = pl->window - 2, v = num - 2; k >= 0 && v >= 0; k--) {
+		int p = age(pl, k + 1);
+
+		while (top >= 2 && !outside(pl, p, pl->stack[top-1], pl->stack[top-2], s0, sign))
+			top--;
+		pl->stack[top++] = p;
+
+		j = pl->hull[v];
+		if (j != age(pl, k))
+			continue;
+		v--;
 
-static void polygon_reset(void)
+		/* stack[top-1] is the oldest hull point, stack[0] is rp.  The
+		 * slope from j to the hull points, oldest first, is unimodal:
+		 * find the first point where it starts to get worse. */
+		{
+			int lo = 0, hi = top - 1;
+
+			while (lo < hi) {
+				int t = (lo + hi) / 2;
+				real cur  = slope(pl, j, s1, pl->stack[top-1-t], s0);
+				real next = slope(pl, j, s1, pl->stack[top-2-t], s0);
+
+				if (sign ? next < cur : next >= cur)
+					hi = t;
+				else
+					lo = t + 1;
+			}
+			segment(pl, j, s1, pl->stack[top-1-lo], s0, &pl->cross[j]);
+		}
+	}
+}
+
+static void polygon_reset(struct phaselock *pl)
 {
-	df.l_min = MIN_INIT;
-	df.r_min = MIN_INIT;
+	pl->df.l_min = pl->k.min_init;
+	pl->df.r_min = pl->k.min_init;
 }
 
-static double find_df(int *flag)
+static real find_df(struct phaselock *pl, int *flag)
 {
-	if (df.l_min == 0.0) {
-		if (df.r_min == 0.0) {
-			return 0.0;   /* every point was OK */
+	if (pl->df.l_min == 0) {
+		if (pl->df.r_min == 0) {
+			return 0;     /* every point was OK */
 		} else {
-			return -df.r_min;
+			return -pl->df.r_min;
 		}
 	} else {
-		if (df.r_min == 0.0) {
-			return df.l_min;
+		if (pl->df.r_min == 0) {
+			return pl->df.l_min;
 		} else {
 			if (flag) *flag=1;
-			return 0.0;   /* some points on each side,
+			return 0;     /* some points on each side,
 			               * or no data at all */
 		}
 	}
@@ -137,57 +373,45 @@ static double find_df(int *flag)
 /* Finds the amount of delta-f required to move a point onto a
  * target line in delta-f/delta-t phase space.  Any line is OK
  * as long as it's not convex and never returns greater than
- * MIN_INIT. */
-static double find_shift(double slope, double offset)
+ * min_init. */
+static real find_shift(struct phaselock *pl, real slope, real offset)
 {
-	double shift  = slope - offset/600.0;
-	double shift2 = slope + 0.3 - offset/6000.0;
+	real shift  = slope - DIV(offset, pl->k.shift_fast);
+	real shift2 = slope + pl->k.shift_bias - DIV(offset, pl->k.shift_slow);
 
 	if (shift2 < shift)
 		shift = shift2;
 
-#ifdef ENABLE_DEBUG
-	DBG("find_shift %f %f -> %f", slope, offset, shift);
-#endif
 	if (shift  < 0)
-		return 0.0;
+		return 0;
 
 	return shift;
 }
 
-static void polygon_point(struct _seg *s)
+static void polygon_point(struct phaselock *pl, struct _seg *s)
 {
-	double l, r;
+	real l, r;
 
-#ifdef ENABLE_DEBUG
-	DBG("loop %f %f", s->slope, s->offset);
-#endif
-
-	l = find_shift(- s->slope,   s->offset);
-	r = find_shift(  s->slope, - s->offset);
-	if (l < df.l_min) df.l_min = l;
-	if (r < df.r_min) df.r_min = r;
-
-#ifdef ENABLE_DEBUG
-	DBG("constraint left:  %f %f", l, df.l_min);
-	DBG("constraint right: %f %f", r, df.r_min);
-#endif
+	l = find_shift(pl, - s->slope,   s->offset);
+	r = find_shift(pl,   s->slope, - s->offset);
+	if (l < pl->df.l_min) pl->df.l_min = l;
+	if (r < pl->df.r_min) pl->df.r_min = r;
 }
 
 /* Something like linear feedback to be used when we are "close" to
  * phase lock.  Not really used at the moment:  the logic in find_df()
  * never sets the flag. */
-static double find_df_center(struct _seg *min, struct _seg *max, double gross_df)
-{
-	const double crit_time=1000.0;
-	double slope  = 0.5 * (max->slope  + min->slope)+gross_df;
-	double dslope =       (max->slope  - min->slope);
-	double offset = 0.5 * (max->offset + min->offset);
-	double doffset =      (max->offset - min->offset);
-	double delta1 = -offset/ 600.0 - slope;
-	double delta2 = -offset/1800.0 - slope;
-	double delta  = 0.0;
-	double factor = crit_time/(crit_time+doffset+dslope*1200.0);
+static real find_df_center(struct phaselock *pl, struct _seg *min, struct _seg *max, real gross_df)
+{
+	const real crit_time=pl->k.crit_time;
+	real slope  = HALF(max->slope  + min->slope)+gross_df;
+	real dslope =     (max->slope  - min->slope);
+	real offset = HALF(max->offset + min->offset);
+	real doffset =    (max->offset - min->offset);
+	real delta1 = DIV(-offset, pl->k.center_fast) - slope;
+	real delta2 = DIV(-offset, pl->k.center_slow) - slope;
+	real delta  = 0;
+	real factor;
 
 	if (offset <  0 && delta2 > 0) delta = delta2;
 	if (offset <  0 && delta1 < 0) delta = delta1;
@@ -195,64 +419,73 @@ static double find_df_center(struct _seg *min, struct _seg *max, double gross_df
 	if (offset >= 0 && delta2 < 0) delta = delta2;
 
 	if (max->offset < -crit_time || min->offset > crit_time)
-		return 0.0;
+		return 0;
 
-#ifdef ENABLE_DEBUG
-	DBG("find_df_center %f %f", delta, factor);
-#endif
+	factor = crit_time+doffset+dslope*1200;
+	if (factor == 0)
+		return 0;
+	factor = DIV(crit_time, factor);
+
+	return MUL(factor, delta);
+}
 
-	return factor * delta;
+/* Copy envelope segments 1..avail-1, the hull vertices, for the trace */
+static void trace_lines(struct phaselock *pl, int max_avail, int min_avail)
+{
+	int c;
+
+	for (c = 1; c < max_avail; c++) {
+		pl->line[c - 1].slope  = DBL(pl->maxseg[c].slope);
+		pl->line[c - 1].offset = DBL(pl->maxseg[c].offset);
+	}
+	for (c = 1; c < min_avail; c++) {
+		pl->line[pl->window + c - 1].slope  = DBL(pl->minseg[c].slope);
+		pl->line[pl->window + c - 1].offset = DBL(pl->minseg[c].offset);
+	}
 }
 
-int contemplate_data(unsigned int absolute, double skew, double errorbar, int freq)
+static int contemplate_data(struct phaselock *pl, unsigned int absolute, real skew, real errorbar, int freq)
 {
 	/*  Here is the actual phase lock loop.
 	 *  Need to keep a ring buffer of points to make a rational
 	 *  decision how to proceed.
 	 */
-	static int rp=0, valid=0;
 	int both_sides_now=0;
-	int j, n, c, max_avail, min_avail, dinit;
-	int nextj=0;	/* initialization not needed; but gcc can't figure out my logic */
-	double cum;
-	struct _seg check, save_min, save_max;
-	double last_slope;
+	int j, k, n, c, max_avail=1, min_avail=1, dinit;
+	real cum;
+	struct _seg check, save_min={0,0}, save_max={0,0};
+	real last_slope;
 	int delta_freq;
-	double delta_f;
+	real delta_f=0;
 	int inconsistent=0, max_imax, max_imin=0, min_imax, min_imin=0;
 	int computed_freq=freq;
+	int max_c = pl->k.max_c;
+	int flags = PHASELOCK_FILLING;
 
-#ifdef ENABLE_DEBUG
-	DBG("contemplate %u %.1f %.1f %d", absolute, skew, errorbar, freq);
-#endif
+	pl->d_ring[pl->rp].absolute = absolute;
+	pl->d_ring[pl->rp].skew     = skew;
+	pl->d_ring[pl->rp].errorbar = errorbar - pl->k.min_delay;   /* quick hack to speed things up */
+	pl->d_ring[pl->rp].freq     = freq;
 
-	d_ring[rp].absolute = absolute;
-	d_ring[rp].skew     = skew;
-	d_ring[rp].errorbar = errorbar - min_delay;   /* quick hack to speed things up */
-	d_ring[rp].freq     = freq;
+	if (pl->valid<pl->window) ++pl->valid;
+	if (pl->valid==pl->window) {
+		flags = 0;
 
-	if (valid<RING_SIZE) ++valid;
-	if (valid==RING_SIZE) {
 		/* Pass 1: correct for wandering freq's */
-		cum = 0.0;
+		cum = 0;
 
-		for (j=rp; ; j=n) {
-			d_ring[j].s.s.max = d_ring[j].skew - cum + d_ring[j].errorbar;
-			d_ring[j].s.s.min = d_ring[j].skew - cum - d_ring[j].errorbar;
+		for (j=pl->rp; ; j=n) {
+			pl->d_ring[j].s.s.max = pl->d_ring[j].skew - cum + pl->d_ring[j].errorbar;
+			pl->d_ring[j].s.s.min = pl->d_ring[j].skew - cum - pl->d_ring[j].errorbar;
 
-#ifdef ENABLE_DEBUG
-			DBG("hist %d %d %f %f %f", j, d_ring[j].absolute - absolute,
-			    cum, d_ring[j].s.s.min, d_ring[j].s.s.max);
-#endif
-
-			n = next_dn(j);
-			if (n == rp) break;
+			n = next_dn(pl, j);
+			if (n == pl->rp) break;
 			/* Assume the freq change took place immediately after
 			 * the data was taken; this is valid for the case where
 			 * this program was responsible for the change.
 			 */
-			cum = cum + (d_ring[j].absolute-d_ring[n].absolute) *
-				(double)(d_ring[j].freq-freq)/65536;
+			cum = cum + (pl->d_ring[j].absolute-pl->d_ring[n].absolute) *
+				(real)(pl->d_ring[j].freq-freq)/FREQ_SCALE;
 		}
 		/*
 		 * Pass 2: find the convex down envelope of s.max, composed of
@@ -260,55 +493,47 @@ int contemplate_data(unsigned int absolute, double skew, double errorbar, int fr
 		 * points in freq vs. dt space.  Find points in order of increasing
 		 * slope == freq
 		 */
-		dinit=1; last_slope=-2*MAX_CORRECT;
-		for (c=1, j=next_up(rp); ; j=nextj) {
-			nextj = search(rp, j, 1, 1, 0, &maxseg[c]);
-			search(rp, j, 0, 1, 1, &check);
-			if (check.slope < maxseg[c].slope && check.slope > last_slope &&
+		dinit=1; last_slope=-2*pl->k.max_correct;
+		n = envelope(pl, 1, 0);
+		crossing(pl, 0, 1, 1, n);
+		for (c=1, k=0; k < n-1; k++) {
+			j = pl->hull[k];
+			segment(pl, j, 1, pl->hull[k+1], 1, &pl->maxseg[c]);
+			check = pl->cross[j];
+			if (check.slope < pl->maxseg[c].slope && check.slope > last_slope &&
 			    (dinit || check.slope < save_min.slope)) {
 				dinit = 0;
 				save_min=check;
 			}
-
-#ifdef ENABLE_DEBUG
-			DBG("maxseg[%d] = %f *x+ %f", c, maxseg[c].slope, maxseg[c].offset);
-
-#endif
-			last_slope = maxseg[c].slope;
+			last_slope = pl->maxseg[c].slope;
 			c++;
-			if (nextj == rp) break;
 		}
 		if (dinit==1) inconsistent=1;
-#ifdef ENABLE_DEBUG
-		if (dinit==0)
-			DBG("mincross %f *x+ %f", save_min.slope, save_min.offset);
-#endif
 		max_avail=c;
 		/*
 		 * Pass 3: find the convex up envelope of s.min, composed of
 		 * line segments in s.min vs. absolute space, which are
 		 * points in freq vs. dt space.  These points are found in
 		 * order of decreasing slope. */
-		dinit=1; last_slope=+2*MAX_CORRECT;
-		for (c=1, j=next_up(rp); ; j=nextj) {
-			nextj = search(rp, j, 0, 0, 1, &minseg[c]);
-			        search(rp, j, 1, 0, 0, &check);
-			if (check.slope > minseg[c].slope && check.slope < last_slope &&
+		dinit=1; last_slope=+2*pl->k.max_correct;
+		n = envelope(pl, 0, 1);
+		crossing(pl, 1, 0, 0, n);
+		for (c=1, k=0; k < n-1; k++) {
+			j = pl->hull[k];
+			segment(pl, j, 0, pl->hull[k+1], 0, &pl->minseg[c]);
+			check = pl->cross[j];
+			if (check.slope > pl->minseg[c].slope && check.slope < last_slope &&
 			    (dinit || check.slope < save_max.slope)) {dinit=0; save_max=check; }
-
-#ifdef ENABLE_DEBUG
-			DBG("minseg[%d] = %f *x+ %f", c, minseg[c].slope, minseg[c].offset);
-#endif
-			last_slope = minseg[c].slope;
+			last_slope = pl->minseg[c].slope;
 			c++;
-			if (nextj == rp) break;
 		}
 		if (dinit==1) inconsistent=1;
-#ifdef ENABLE_DEBUG
-		if (dinit==0)
-			DBG("maxcross %f *x+ %f", save_max.slope, save_max.offset);
-#endif
 		min_avail=c;
+
+		/* the envelopes, before pass 4 splices in save_min/max */
+		if (pl->trace_fn)
+			trace_lines(pl, max_avail, min_avail);
+
 		/*
 		 * Pass 4: splice together the convex polygon that forms
 		 * the envelope of slope/offset coordinates that are consistent
@@ -316,86 +541,680 @@ int contemplate_data(unsigned int absolute, double skew, double errorbar, int fr
 		 * doesn't matter for the frequency shift determination, but
 		 * the order chosen is nice for visual display. */
 		if (!inconsistent) {
-		polygon_reset();
-		polygon_point(&save_min);
+		polygon_reset(pl);
+		polygon_point(pl, &save_min);
 		for (dinit=1, c=1; c<max_avail; c++) {
-			if (dinit && maxseg[c].slope > save_min.slope) {
+			if (dinit && pl->maxseg[c].slope > save_min.slope) {
 				max_imin = c-1;
-				maxseg[max_imin] = save_min;
+				pl->maxseg[max_imin] = save_min;
 				dinit = 0;
 			}
-			if (maxseg[c].slope > save_max.slope)
+			if (pl->maxseg[c].slope > save_max.slope)
 				break;
-			if (dinit==0) polygon_point(&maxseg[c]);
+			if (dinit==0) polygon_point(pl, &pl->maxseg[c]);
 		}
 		if (dinit) {
-#ifdef ENABLE_DEBUG
-			DBG("found maxseg vs. save_min inconsistency");
-#endif
+			flags |= PHASELOCK_MAXSEG;
 			inconsistent=1;
 		}
 		max_imax = c;
-		maxseg[max_imax] = save_max;
+		pl->maxseg[max_imax] = save_max;
 
-		polygon_point(&save_max);
+		polygon_point(pl, &save_max);
 		for (dinit=1, c=1; c<min_avail; c++) {
-			if (dinit && minseg[c].slope < save_max.slope) {
+			if (dinit && pl->minseg[c].slope < save_max.slope) {
 				max_imin = c-1;
-				minseg[min_imin] = save_max;
+				pl->minseg[min_imin] = save_max;
 				dinit = 0;
 			}
-			if (minseg[c].slope < save_min.slope)
+			if (pl->minseg[c].slope < save_min.slope)
 				break;
-			if (dinit==0) polygon_point(&minseg[c]);
+			if (dinit==0) polygon_point(pl, &pl->minseg[c]);
 		}
 		if (dinit) {
-#ifdef ENABLE_DEBUG
-			DBG("found minseg vs. save_max inconsistency");
-#endif
+			flags |= PHASELOCK_MINSEG;
 			inconsistent=1;
 		}
 		min_imax = c;
-		minseg[min_imax] = save_max;
-
-		/* not needed for analysis, but shouldn't hurt either */
-#ifdef ENABLE_DEBUG
-		polygon_point(&save_min);
-#endif
+		pl->minseg[min_imax] = save_max;
 		} /* !inconsistent */
 
 		/*
 		 * Pass 5: decide on a new freq */
 		if (inconsistent) {
-#ifdef ENABLE_DEBUG
-			DBG("# inconsistent");
-#endif
+			flags |= PHASELOCK_INCONSISTENT;
 		} else {
-			delta_f = find_df(&both_sides_now);
-#ifdef ENABLE_DEBUG
-			DBG("find_df() = %e", delta_f);
-#endif
-			delta_f += find_df_center(&save_min,&save_max, delta_f);
-			delta_freq = delta_f*65536+.5;
-
-#ifdef ENABLE_DEBUG
-			DBG("delta_f %f  delta_freq %d  bsn %d", delta_f, delta_freq, both_sides_now);
-#endif
+			delta_f = find_df(pl, &both_sides_now);
+			delta_f += find_df_center(pl, &save_min,&save_max, delta_f);
+			delta_freq = FREQ(delta_f);
 			computed_freq -= delta_freq;
+			if (computed_freq < -max_c) computed_freq=-max_c;
+			if (computed_freq >  max_c) computed_freq= max_c;
+			if (both_sides_now) flags |= PHASELOCK_BOTH_SIDES;
+		}
+	}
+	pl->rp = (pl->rp+1)%pl->window;
 
-#ifdef ENABLE_DEBUG
-			DBG("# box [( %.3f , %.1f ) ",  save_min.slope, save_min.offset);
-			DBG("       ( %.3f , %.1f )] ", save_max.slope, save_max.offset);
- 			DBG(" delta_f %.3f computed_freq %d", delta_f, computed_freq);
-#endif
-			if (computed_freq < -MAX_C) computed_freq=-MAX_C;
-			if (computed_freq >  MAX_C) computed_freq= MAX_C;
+	PROBE(phaselock_freq, absolute, PHASELOCK_POLYGON, freq, computed_freq, flags);
+	if (pl->trace_fn) {
+		struct phaselock_trace t;
+
+		memset(&t, 0, sizeof(t));
+		t.absolute   = absolute;
+		t.engine     = PHASELOCK_POLYGON;
+		t.flags      = flags;
+		t.freq       = freq;
+		t.new_freq   = computed_freq;
+		t.skew       = DBL(skew);
+		t.errorbar   = DBL(errorbar);
+		t.delta_f    = -DBL(delta_f);
+		t.save_min.slope  = DBL(save_min.slope);
+		t.save_min.offset = DBL(save_min.offset);
+		t.save_max.slope  = DBL(save_max.slope);
+		t.save_max.offset = DBL(save_max.offset);
+		if (!(flags & PHASELOCK_FILLING)) {
+			t.num_max = max_avail - 1;
+			t.num_min = min_avail - 1;
+			t.maxseg  = pl->line;
+			t.minseg  = pl->line + pl->window;
 		}
+		pl->trace_fn(&t, pl->trace_arg);
 	}
-	rp = (rp+1)%RING_SIZE;
 
 	return computed_freq;
 }
 
+/*
+ * Kalman engine.  The state is the skew, server minus local time, and
+ * its rate, which is the remaining frequency error.  A frequency change
+ * is assumed to take effect right after the sample, like in pass 1 of
+ * contemplate_data(), and is seen as a step in the rate.  The rate
+ * wanders as a random walk, and each sample has white noise, plus half
+ * its delay above the smallest recent delay.
+ *
+ * Neither noise level is known up front, both are estimated from the
+ * sample stream.  The measurement noise from how far each sample is off
+ * the line through its neighbours, which a smooth frequency error does
+ * not affect.  The random walk by covariance matching, from the rate
+ * corrections the innovations cause: a filter with too small a random
+ * walk lags the frequency, the innovations grow, and so does the
+ * estimate, and vice versa.
+ */
+#define KALMAN_N      16	/* samples in the noise averages */
+#define KALMAN_MIN_R  1.0	/* usec^2, floor of measurement noise */
+#define KALMAN_Q      1e-6	/* ppm^2/sec, initial random walk */
+#define KALMAN_MIN_Q  1e-12
+#define KALMAN_MAX_Q  1.0
+#define KALMAN_GATE   25.0	/* squared innovation of an outlier, in sigmas */
+#define KALMAN_SPIKES 3		/* consecutive outliers before restart */
+
+static void kalman_start(struct phaselock *pl, unsigned int absolute, double skew, double errorbar, int freq)
+{
+	struct kalman *kf = &pl->kf;
+	double err = (errorbar - pl->param.min_delay) / 2;
+
+	memset(kf, 0, sizeof(*kf));
+	kf->init    = 1;
+	kf->last    = absolute;
+	kf->freq    = freq;
+	kf->x[0]    = skew;
+	kf->r       = err * err > KALMAN_MIN_R ? err * err : KALMAN_MIN_R;
+	kf->p[0][0] = kf->r;
+	kf->p[1][1] = pl->param.max_correct * pl->param.max_correct;
+	kf->q       = KALMAN_Q;
+	kf->min_err = errorbar;
+	kf->num     = 1;
+	kf->h[1].t  = absolute;
+	kf->h[1].z  = skew;
+}
+
+static int kalman_trace(struct phaselock *pl, unsigned int absolute, double skew, double errorbar,
+			int freq, int new_freq, int flags, double delta)
+{
+	struct phaselock_trace t;
+
+	PROBE(phaselock_freq, absolute, PHASELOCK_KALMAN, freq, new_freq, flags);
+	if (!pl->trace_fn)
+		return new_freq;
+
+	memset(&t, 0, sizeof(t));
+	t.absolute   = absolute;
+	t.engine     = PHASELOCK_KALMAN;
+	t.flags      = flags;
+	t.freq       = freq;
+	t.new_freq   = new_freq;
+	t.skew       = skew;
+	t.errorbar   = errorbar;
+	t.delta_f    = delta;
+	t.est_skew   = pl->kf.x[0];
+	t.est_rate   = pl->kf.x[1];
+	t.noise      = sqrt(pl->kf.r);
+	t.wander     = pl->kf.q;
+	pl->trace_fn(&t, pl->trace_arg);
+
+	return new_freq;
+}
+
+static int kalman_update(struct phaselock *pl, unsigned int absolute, double skew, double errorbar, int freq)
+{
+	struct kalman *kf = &pl->kf;
+	double dt, u, excess, r, v, s, k0, k1, p00, p01, delta;
+	int new_freq, max_c = pl->k.max_c;
+
+	if (!kf->init || absolute <= kf->last) {
+		kalman_start(pl, absolute, skew, errorbar, freq);
+		return kalman_trace(pl, absolute, skew, errorbar, freq, freq, PHASELOCK_FILLING, 0);
+	}
+
+	/* predict, after the frequency change since last sample */
+	dt = absolute - kf->last;
+	u  = (double)(freq - kf->freq) / 65536;
+	kf->x[1] -= u;
+	kf->h[0].z += u * (kf->last - kf->h[0].t);
+	kf->h[1].z += u * (kf->last - kf->h[1].t);
+	kf->x[0] += kf->x[1] * dt;
+	kf->p[0][0] += dt * (kf->p[0][1] + kf->p[1][0]) + dt * dt * kf->p[1][1] + kf->q * dt * dt * dt / 3;
+	kf->p[0][1] += dt * kf->p[1][1] + kf->q * dt * dt / 2;
+	kf->p[1][0]  = kf->p[0][1];
+	kf->p[1][1] += kf->q * dt;
+	kf->last = absolute;
+	kf->freq = freq;
+
+	/* slowly forget the smallest delay, the route may have changed */
+	if (errorbar < kf->min_err)
+		kf->min_err = errorbar;
+	else
+		kf->min_err += (errorbar - kf->min_err) / (KALMAN_N * KALMAN_N);
+	/* queueing of excess, split at random between the directions */
+	excess = errorbar - kf->min_err;
+	r = kf->r + excess * excess / 12;
+
+	v = skew - kf->x[0];
+	s = kf->p[0][0] + r;
+	if (v * v / s > KALMAN_GATE) {
+		if (++kf->spikes >= KALMAN_SPIKES)
+			kalman_start(pl, absolute, skew, errorbar, freq);
+		return kalman_trace(pl, absolute, skew, errorbar, freq, freq, PHASELOCK_OUTLIER, 0);
+	}
+	kf->spikes = 0;
+
+	/* measurement noise, from the middle of the last three samples */
+	if (kf->num++ >= 2) {
+		double t0 = kf->h[0].t, t1 = kf->h[1].t, t2 = absolute;
+		double a = (t2 - t1) / (t2 - t0), b = (t1 - t0) / (t2 - t0);
+		double e = kf->h[1].z - a * kf->h[0].z - b * skew;
+		double d2 = kf->h[1].d * kf->h[1].d + a * a * kf->h[0].d * kf->h[0].d + b * b * excess * excess;
+
+		kf->r += ((e * e - d2 / 12) / (1 + a * a + b * b) - kf->r) /
+			(kf->num < KALMAN_N ? kf->num - 1 : KALMAN_N);
+		if (kf->r < KALMAN_MIN_R)
+			kf->r = KALMAN_MIN_R;
+	}
+	kf->h[0] = kf->h[1];
+	kf->h[1].t = absolute;
+	kf->h[1].z = skew;
+	kf->h[1].d = excess;
+
+	/* update */
+	p00 = kf->p[0][0];
+	p01 = kf->p[0][1];
+	k0 = p00 / s;
+	k1 = kf->p[1][0] / s;
+	kf->x[0] += k0 * v;
+	kf->x[1] += k1 * v;
+	kf->p[0][0] -= k0 * p00;
+	kf->p[0][1] -= k0 * p01;
+	kf->p[1][0]  = kf->p[0][1];
+	kf->p[1][1] -= k1 * p01;
+
+	/* random walk */
+	kf->q += (k1 * k1 * v * v / dt - kf->q) / KALMAN_N;
+	if (kf->q < KALMAN_MIN_Q)
+		kf->q = KALMAN_MIN_Q;
+	if (kf->q > KALMAN_MAX_Q)
+		kf->q = KALMAN_MAX_Q;
+
+	/* cancel the rate and steer the skew to zero */
+	delta = kf->x[1] + kf->x[0] / pl->param.kalman_tau;
+	if (delta >  pl->param.min_init) delta =  pl->param.min_init;
+	if (delta < -pl->param.min_init) delta = -pl->param.min_init;
+
+
+	new_freq = freq + (int)lround(delta * 65536);
+	if (new_freq < -max_c) new_freq = -max_c;
+	if (new_freq >  max_c) new_freq =  max_c;
+
+	return kalman_trace(pl, absolute, skew, errorbar, freq, new_freq, 0, delta);
+}
+
+/* Kalman engine entry, also keeps the ring for phaselock_save() */
+static int kalman_feed(struct phaselock *pl, unsigned int absolute, double skew, double errorbar, int freq)
+{
+	pl->d_ring[pl->rp].absolute = absolute;
+	pl->d_ring[pl->rp].skew     = REAL(skew);
+	pl->d_ring[pl->rp].errorbar = REAL(errorbar - pl->param.min_delay);
+	pl->d_ring[pl->rp].freq     = freq;
+	if (pl->valid < pl->window) ++pl->valid;
+	pl->rp = (pl->rp + 1) % pl->window;
+
+	return kalman_update(pl, absolute, skew, errorbar, freq);
+}
+
+/*
+ * Frequency history, independent of the engine, for holdover when the
+ * server is gone for hours.  The output frequency of each sample goes
+ * into hourly and daily min/max/mean buckets, bounded rings of each.
+ * Every completed hour feeds a Holt-Winters predictor: a level and a
+ * trend, for ageing, with exponential forgetting by time, plus a mean
+ * deviation for each hour of the day, for diurnal temperature swings.
+ * All O(1) per sample.
+ *
+ * The model is only trusted as far as it has shown skill: each hour it
+ * predicts HIST_SKILL hours ahead, and phaselock_predict() uses trend,
+ * or trend and season, only when that beat holding the frequency.
+ */
+#define HIST_LEVEL  (6 * 3600.0)	/* sec, time constant of level */
+#define HIST_TREND  (3 * 86400.0)	/* sec, time constant of trend */
+#define HIST_SEASON 7			/* days, averaged per hour of day */
+#define HIST_MIN    6			/* hours, before any prediction */
+#define HIST_SKILL  6			/* hours, horizon of skill score */
+#define HIST_ERR    72			/* hours, averaging of skill score */
+
+static void bucket_add(struct bucket *b, unsigned int start, int num, int min, int max, double sum)
+{
+	if (!b->num) {
+		b->start = start;
+		b->min   = min;
+		b->max   = max;
+	}
+	if (min < b->min) b->min = min;
+	if (max > b->max) b->max = max;
+	b->num += num;
+	b->sum += sum;
+}
+
+/* Score the models on how they would have predicted this hour */
+static void history_skill(struct history *h, struct bucket *b, int slot)
+{
+	struct bucket *o = &h->hour[(h->h + HIST_HOURS - HIST_SKILL) % HIST_HOURS];
+	double mean = b->sum / b->num, past, dt, e[3];
+	int i;
+
+	if (!o->num || b->start / 3600 - o->start / 3600 != HIST_SKILL)
+		return;
+
+	past = o->sum / o->num;
+	dt   = (double)b->start - o->start;
+	e[0] = mean - past;
+	e[1] = e[0] - h->trend * dt;
+	e[2] = e[1] - h->season[slot] + h->season[(slot + 24 - HIST_SKILL) % 24];
+
+	for (i = 0; i < 3; i++)
+		h->err[i] += (e[i] * e[i] - h->err[i]) / HIST_ERR;
+}
+
+/* Fold a completed hour into the predictor */
+static void history_predictor(struct history *h, struct bucket *b)
+{
+	unsigned int t = b->start - b->start % 3600 + 1800;
+	int slot = t % 86400 / 3600;
+	double mean = b->sum / b->num;
+	double dt, pred, level, m = 0;
+	int i;
+
+	history_skill(h, b, slot);
+	if (!h->hours) {
+		h->level = mean;
+		h->trend = 0;
+	} else {
+		dt    = (double)t - h->t;
+		pred  = h->level + h->trend * dt;
+		level = pred + (1 - exp(-dt / HIST_LEVEL)) * (mean - h->season[slot] - pred);
+		h->trend += (1 - exp(-dt / HIST_TREND)) * ((level - h->level) / dt - h->trend);
+		h->level  = level;
+	}
+	h->t = t;
+	h->hours++;
+
+	/* seasonal part is the mean deviation, so keep it centered */
+	h->season[slot] += (mean - h->level - h->season[slot]) / HIST_SEASON;
+	for (i = 0; i < 24; i++)
+		m += h->season[i];
+	for (i = 0; i < 24; i++)
+		h->season[i] -= m / 24;
+}
+
+static void history_close_hour(struct history *h, struct bucket *b)
+{
+	struct bucket *d = &h->day[h->d];
+
+	history_predictor(h, b);
+
+	if (d->num && b->start / 86400 != d->start / 86400) {
+		INFO("Frequency %u: mean %.3f ppm, min %.3f, max %.3f", d->start / 86400,
+		     d->sum / d->num / 65536, d->min / 65536.0, d->max / 65536.0);
+		h->d = (h->d + 1) % HIST_DAYS;
+		d = &h->day[h->d];
+		memset(d, 0, sizeof(*d));
+	}
+	bucket_add(d, b->start, b->num, b->min, b->max, b->sum);
+}
+
+static void history_add(struct phaselock *pl, unsigned int absolute, int freq)
+{
+	struct history *h = &pl->hist;
+	struct bucket *b = &h->hour[h->h];
+
+	if (b->num && absolute < b->start) {
+		memset(h, 0, sizeof(*h));	/* time went backwards */
+		b = &h->hour[0];
+	}
+	if (b->num && absolute / 3600 != b->start / 3600) {
+		history_close_hour(h, b);
+		h->h = (h->h + 1) % HIST_HOURS;
+		b = &h->hour[h->h];
+		memset(b, 0, sizeof(*b));
+	}
+	bucket_add(b, absolute, 1, freq, freq, freq);
+	h->last_t = absolute;
+	h->last   = freq;
+}
+
+/* Round up to keep arrays in the phase lock memory block aligned */
+#define ALIGN(sz) (((sz) + sizeof(double) - 1) & ~(sizeof(double) - 1))
+
+/* Size of memory block needed for a phase lock with given window */
+size_t phaselock_size(int window)
+{
+	return ALIGN(sizeof(struct phaselock)) +
+		ALIGN(window * sizeof(struct datum)) +
+		ALIGN(2 * (window + 1) * sizeof(struct _seg)) +
+		ALIGN(window * sizeof(struct _seg)) +
+		ALIGN(2 * window * sizeof(int)) +
+		ALIGN(2 * window * sizeof(struct phaselock_line));
+}
+
+/*
+ * Set up a phase lock in caller provided memory, at least of the size
+ * returned by phaselock_size(), suitably aligned for a double.  Useful
+ * with static or pooled memory.  Returns NULL if window is out of range,
+ * 3 to WINDOW_MAX samples.
+ */
+struct phaselock *phaselock_init(void *mem, int window)
+{
+	struct phaselock *pl = mem;
+	char *ptr = mem;
+
+	if (!mem || window < 3 || window > WINDOW_MAX) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	memset(mem, 0, phaselock_size(window));
+	pl->window = window;
+	phaselock_param(pl, &phaselock_defaults);
+
+	ptr += ALIGN(sizeof(struct phaselock));
+	pl->d_ring = (struct datum *)ptr;
+	ptr += ALIGN(window * sizeof(struct datum));
+	pl->maxseg = (struct _seg *)ptr;
+	pl->minseg = pl->maxseg + window + 1;
+	ptr += ALIGN(2 * (window + 1) * sizeof(struct _seg));
+	pl->cross  = (struct _seg *)ptr;
+	ptr += ALIGN(window * sizeof(struct _seg));
+	pl->hull   = (int *)ptr;
+	pl->stack  = pl->hull + window;
+	ptr += ALIGN(2 * window * sizeof(int));
+	pl->line   = (struct phaselock_line *)ptr;
+
+	return pl;
+}
+
+/* Allocate and set up a phase lock, window is the ring buffer size */
+struct phaselock *phaselock_create(int window)
+{
+	struct phaselock *pl;
+	void *mem;
+
+	if (window < 3 || window > WINDOW_MAX) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	mem = malloc(phaselock_size(window));
+	if (!mem)
+		return NULL;
+
+	pl = phaselock_init(mem, window);
+	if (!pl)
+		free(mem);
+
+	return pl;
+}
+
+/* Free a phase lock from phaselock_create(), not phaselock_init() */
+void phaselock_destroy(struct phaselock *pl)
+{
+	free(pl);
+}
+
+/*
+ * Change tuning parameters of an instance, takes effect next sample.
+ * The window is fixed when the instance is created and is kept.
+ */
+void phaselock_param(struct phaselock *pl, const struct phaselock_param *param)
+{
+	pl->param = *param;
+	pl->param.window = pl->window;
+
+	pl->k.min_delay   = REAL(param->min_delay);
+	pl->k.max_correct = REAL(param->max_correct);
+	pl->k.min_init    = REAL(param->min_init);
+	pl->k.shift_fast  = REAL(param->shift_fast);
+	pl->k.shift_slow  = REAL(param->shift_slow);
+	pl->k.shift_bias  = REAL(param->shift_bias);
+	pl->k.crit_time   = REAL(param->crit_time);
+	pl->k.center_fast = REAL(param->center_fast);
+	pl->k.center_slow = REAL(param->center_slow);
+	pl->k.max_c       = param->max_correct * 65536;
+}
+
+/*
+ * Parse comma separated list of name=value into param, e.g.
+ * "shift_fast=300,min_init=10".  The window only applies to instances
+ * created after, with phaselock_create(param->window).  Returns -1 on unknown name, or
+ * missing or invalid value.
+ */
+int phaselock_tune(struct phaselock_param *param, char *spec)
+{
+	char *name, *arg, *end;
+	double val;
+	int i;
+
+	while ((name = strsep(&spec, ","))) {
+		if (!*name)
+			continue;
+
+		arg = strchr(name, '=');
+		if (!arg) {
+			ERR(0, "Missing value for phase lock parameter %s", name);
+			return -1;
+		}
+		*arg++ = 0;
+
+		if (!strcmp(name, "engine")) {
+			for (i = 0; i < NUM_ENGINE; i++) {
+				if (!strcmp(arg, engine_name[i]))
+					break;
+			}
+			if (i == NUM_ENGINE) {
+				ERR(0, "Unknown phase lock engine %s", arg);
+				return -1;
+			}
+			param->engine = i;
+			continue;
+		}
+
+		if (!strcmp(name, "window")) {
+			long num = strtol(arg, &end, 10);
+
+			if (end == arg || *end || num < 3 || num > WINDOW_MAX) {
+				ERR(0, "Invalid phase lock window %s, 3-%d samples", arg, WINDOW_MAX);
+				return -1;
+			}
+			param->window = num;
+			continue;
+		}
+
+		for (i = 0; i < NUM_PARAM; i++) {
+			if (strcmp(name, param_list[i].name))
+				continue;
+
+			val = strtod(arg, &end);
+			if (end == arg || *end || !isfinite(val) || fabs(val) > PARAM_MAX ||
+			    (param_list[i].positive && val <= 0)) {
+				ERR(0, "Invalid value %s for phase lock parameter %s", arg, name);
+				return -1;
+			}
+			*PARAM_VAL(param, i) = val;
+			break;
+		}
+		if (i == NUM_PARAM) {
+			ERR(0, "Unknown phase lock parameter %s", name);
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+/* Format param as a list that phaselock_tune() accepts */
+char *phaselock_spec(const struct phaselock_param *param, char *buf, size_t len)
+{
+	size_t pos;
+	int i;
+
+	pos = snprintf(buf, len, "engine=%s,window=%d", engine_name[param->engine], param->window);
+	for (i = 0; i < NUM_PARAM && pos < len; i++)
+		pos += snprintf(&buf[pos], len - pos, ",%s=%g", param_list[i].name,
+				*(const double *)((const char *)param + param_list[i].offset));
+
+	return buf;
+}
+
+/*
+ * Subscribe to a trace record per sample, NULL to unsubscribe.  The fn
+ * is called from phaselock_feed(), the record and its arrays are only
+ * valid during the call.  Without subscriber nothing is recorded.
+ */
+void phaselock_subscribe(struct phaselock *pl, phaselock_trace_fn *fn, void *arg)
+{
+	pl->trace_fn  = fn;
+	pl->trace_arg = arg;
+}
+
+/* Forget all samples, e.g. after a clock step */
+void phaselock_reset(struct phaselock *pl)
+{
+	pl->rp = pl->valid = 0;
+	pl->kf.init = 0;
+	memset(&pl->hist, 0, sizeof(pl->hist));
+}
+
+/*
+ * Feed a new sample, skew and errorbar in microseconds, freq is the
+ * current kernel frequency.  Returns the new frequency to use.
+ */
+int phaselock_feed(struct phaselock *pl, unsigned int absolute, double skew, double errorbar, int freq)
+{
+	int new_freq;
+
+	if (pl->param.engine == PHASELOCK_KALMAN)
+		new_freq = kalman_feed(pl, absolute, skew, errorbar, freq);
+	else
+		new_freq = contemplate_data(pl, absolute, REAL(skew), REAL(errorbar), freq);
+	history_add(pl, absolute, new_freq);
+
+	return new_freq;
+}
+
+/*
+ * Predict the frequency at a later time from the history, for holdover.
+ * Returns 0 and the frequency in *freq, or -1 if there is too little
+ * history yet.
+ */
+int phaselock_predict(struct phaselock *pl, unsigned int absolute, int *freq)
+{
+	struct history *h = &pl->hist;
+	double f;
+
+	if (h->hours < HIST_MIN)
+		return -1;
+
+	/* from the last sample on, the level is stale by then */
+	f = h->last;
+	if (h->err[1] < h->err[0] || h->err[2] < h->err[0])
+		f += h->trend * ((double)absolute - h->last_t);
+	if (h->hours >= 24 && h->err[2] < h->err[0] && h->err[2] < h->err[1])
+		f += h->season[absolute % 86400 / 3600] - h->season[h->last_t % 86400 / 3600];
+
+	if (f < -pl->k.max_c) f = -pl->k.max_c;
+	if (f >  pl->k.max_c) f =  pl->k.max_c;
+	*freq = (int)lround(f);
+
+	return 0;
+}
+
+/* Save ring buffer to state file, oldest entry first */
+int phaselock_save(struct phaselock *pl, FILE *fp)
+{
+	int i, j;
+
+	fprintf(fp, "ring %d %d\n", pl->window, pl->valid);
+	for (i = 0, j = (pl->rp + pl->window - pl->valid) % pl->window; i < pl->valid; i++, j = next_up(pl, j))
+		fprintf(fp, "%u %.17g %.17g %d\n", pl->d_ring[j].absolute,
+			DBL(pl->d_ring[j].skew), DBL(pl->d_ring[j].errorbar), pl->d_ring[j].freq);
+
+	return ferror(fp) ? -1 : 0;
+}
+
+/*
+ * Restore ring buffer from state file, must match our window size.  The
+ * kalman engine keeps the ring as well, and is rebuilt by replaying it.
+ */
+int phaselock_load(struct phaselock *pl, FILE *fp)
+{
+	int i, size, num;
+
+	if (fscanf(fp, " ring %d %d", &size, &num) != 2 || size != pl->window ||
+	    num < 0 || num > pl->window)
+		return -1;
+
+	for (i = 0; i < num; i++) {
+		double skew, errorbar;
+
+		if (fscanf(fp, "%u %lf %lf %d", &pl->d_ring[i].absolute,
+			   &skew, &errorbar, &pl->d_ring[i].freq) != 4) {
+			pl->valid = pl->rp = 0;
+			return -1;
+		}
+		pl->d_ring[i].skew     = REAL(skew);
+		pl->d_ring[i].errorbar = REAL(errorbar);
+	}
+	pl->valid = num;
+	pl->rp    = num % pl->window;
+
+	pl->kf.init = 0;
+	if (pl->param.engine == PHASELOCK_KALMAN) {
+		for (i = 0; i < num; i++)
+			kalman_update(pl, pl->d_ring[i].absolute, DBL(pl->d_ring[i].skew),
+				      DBL(pl->d_ring[i].errorbar) + pl->param.min_delay,
+				      pl->d_ring[i].freq);
+	}
+
+	return 0;
+}
+
 /**
  * Local Variables:
  *  indent-tabs-mode: t
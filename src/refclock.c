@@ -0,0 +1,339 @@
+/* Local reference clocks, ntpd SHM segments and chrony SOCK samples
+ *
+ * Copyright (C) 2010-2022  Joachim Wiberg <troglobit@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License (Version 2,
+ * June 1991) as published by the Free Software Foundation.  At the
+ * time of writing, that license was published by the FSF with the URL
+ * http://www.gnu.org/copyleft/gpl.html, and is incorporated herein by
+ * reference.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+/*
+ * A reference clock on the same host, e.g. a GPS receiver via gpsd,
+ * as the source of time instead of the network server.  Two kinds, the
+ * same as ntpd and chrony read, so existing drivers work unchanged:
+ *
+ *     shm:N       ntpd's shared memory segment N, key 0x4e545030 + N,
+ *                 read every second using its count/valid protocol
+ *     sock:PATH   chrony's SOCK, struct sock_sample datagrams sent to
+ *                 a UNIX socket at PATH
+ *
+ * A thread collects the samples, each the offset of the reference to
+ * the system clock.  Every poll the client takes the median of those
+ * since the last, see refclock_poll(), and feeds it to the discipline
+ * like a network sample.  PPS only samples, without the seconds, and
+ * leap second announcements are ignored.
+ */
+
+#include "config.h"
+#include <pthread.h>
+#include <signal.h>
+#include <sys/ipc.h>
+#include <sys/param.h>		/* MIN()/MAX() */
+#include <sys/shm.h>
+#include <sys/un.h>
+#include "sntpd.h"
+
+#define SHM_KEY      0x4e545030	/* "NTP0" */
+#define SHM_STALE    4		/* sec, older samples are ignored */
+#define SOCK_MAGIC   0x534f434b	/* "SOCK" */
+#define REFCLOCK_MAX 64		/* samples per poll, the latest are kept */
+
+/* ntpd's refclock_shm.c, the layout is ABI, also on 64-bit hosts */
+struct shm_time {
+	int          mode;	/* 0: valid only, 1: count and valid */
+	volatile int count;
+	time_t       clock_sec;	/* reference */
+	int          clock_usec;
+	time_t       recv_sec;	/* system clock */
+	int          recv_usec;
+	int          leap;
+	int          precision;
+	int          nsamples;
+	volatile int valid;
+	unsigned     clock_nsec;
+	unsigned     recv_nsec;
+	int          dummy[8];
+};
+
+/* chrony's refclock_sock.c */
+struct sock_sample {
+	struct timeval tv;	/* system clock */
+	double offset;		/* sec, reference - system clock */
+	int    pulse;		/* PPS, offset to the second only */
+	int    leap;
+	int    pad;
+	int    magic;
+};
+
+static struct {
+	pthread_mutex_t lock;
+	double offset[REFCLOCK_MAX];	/* usec */
+	unsigned int num;		/* since last poll */
+	struct ntptime last;		/* system clock, latest sample */
+} samples = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+static pthread_t refclock_tid;
+static int refclock_running;
+static struct shm_time *shm;
+static int sock_sd = -1;
+static char *sock_path;
+static char refid[4];
+
+static void refclock_add(time_t sec, long nsec, double offset)
+{
+	pthread_mutex_lock(&samples.lock);
+	samples.offset[samples.num % REFCLOCK_MAX] = offset;
+	samples.num++;
+	samples.last.coarse = sec + JAN_1970;
+	samples.last.fine   = NTPFRAC(nsec / 1000);
+	pthread_mutex_unlock(&samples.lock);
+}
+
+/* One sample from the segment, if there is a new and consistent one */
+static void shm_read(void)
+{
+	struct shm_time t;
+	struct timespec now;
+	int count;
+
+	if (!shm->valid)
+		return;
+
+	count = shm->count;
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	memcpy(&t, shm, sizeof(t));
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (t.mode == 1 && count != shm->count) {
+		DBG("SHM sample torn, writer was busy");
+		shm->valid = 0;
+		return;
+	}
+	shm->valid = 0;
+
+	/* Writers that predate the nsec fields leave them zero */
+	if (t.clock_nsec / 1000 != (unsigned)t.clock_usec || t.recv_nsec / 1000 != (unsigned)t.recv_usec) {
+		t.clock_nsec = t.clock_usec * 1000;
+		t.recv_nsec  = t.recv_usec * 1000;
+	}
+
+	clock_gettime(CLOCK_REALTIME, &now);
+	if (now.tv_sec - t.recv_sec > SHM_STALE) {
+		DBG("SHM sample %ld sec old, ignoring", (long)(now.tv_sec - t.recv_sec));
+		return;
+	}
+
+	refclock_add(t.recv_sec, t.recv_nsec,
+		     (t.clock_sec - t.recv_sec) * 1e6 + ((double)t.clock_nsec - t.recv_nsec) / 1e3);
+}
+
+static void sock_read(const struct sock_sample *s, ssize_t num)
+{
+	if (num == -1) {
+		if (errno != EINTR)
+			ERR(errno, "Failed reading refclock socket");
+		return;
+	}
+	if (num != sizeof(*s) || s->magic != SOCK_MAGIC) {
+		DBG("Invalid refclock sample, %zd bytes", num);
+		return;
+	}
+	if (s->pulse) {
+		DBG("PPS refclock sample, no seconds, ignoring");
+		return;
+	}
+
+	refclock_add(s->tv.tv_sec, s->tv.tv_usec * 1000L, s->offset * 1e6);
+}
+
+static void *refclock_thread(void *arg)
+{
+	struct sock_sample s;
+	ssize_t num;
+
+	(void)arg;
+	pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+	while (1) {
+		/* Only allow refclock_exit() to cancel us while waiting */
+		pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+		if (shm) {
+			sleep(1);
+			pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+			shm_read();
+		} else {
+			num = recv(sock_sd, &s, sizeof(s), 0);
+			pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+			sock_read(&s, num);
+		}
+	}
+
+	return NULL;
+}
+
+static int shm_open_unit(int unit)
+{
+	int id;
+
+	/* ntpd's permissions, units 0 and 1 are for root only */
+	id = shmget(SHM_KEY + unit, sizeof(struct shm_time), IPC_CREAT | (unit < 2 ? 0600 : 0666));
+	if (id == -1)
+		return -1;
+
+	shm = shmat(id, NULL, 0);
+	if (shm == (void *)-1) {
+		shm = NULL;
+		return -1;
+	}
+
+	return 0;
+}
+
+static int sock_open(const char *path)
+{
+	struct sockaddr_un sa;
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sun_family = AF_UNIX;
+	if (strlen(path) >= sizeof(sa.sun_path)) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	strcpy(sa.sun_path, path);
+
+	sock_sd = socket(AF_UNIX, SOCK_DGRAM, 0);
+	if (sock_sd == -1)
+		return -1;
+
+	unlink(path);
+	if (bind(sock_sd, (struct sockaddr *)&sa, sizeof(sa))) {
+		close(sock_sd);
+		sock_sd = -1;
+		return -1;
+	}
+	sock_path = strdup(path);
+
+	return 0;
+}
+
+/*
+ * Open reference clock, spec is shm:N or sock:PATH, and start reading
+ * samples.  Returns 0 on success, -1 on error.
+ */
+int refclock_init(const char *spec)
+{
+	sigset_t set, old;
+	int rc;
+
+	if (!strncmp(spec, "shm:", 4)) {
+		char *end;
+		long unit;
+
+		unit = strtol(spec + 4, &end, 10);
+		if (*end || end == spec + 4 || unit < 0 || unit > 255) {
+			ERR(0, "Invalid refclock %s, SHM unit 0..255", spec);
+			return -1;
+		}
+		if (shm_open_unit(unit)) {
+			ERR(errno, "Failed attaching refclock SHM unit %ld", unit);
+			return -1;
+		}
+		memcpy(refid, "SHM", 4);
+	} else if (!strncmp(spec, "sock:", 5)) {
+		if (sock_open(spec + 5)) {
+			ERR(errno, "Failed opening refclock socket %s", spec + 5);
+			return -1;
+		}
+		memcpy(refid, "SOCK", 4);
+	} else {
+		ERR(0, "Invalid refclock %s, use shm:N or sock:PATH", spec);
+		return -1;
+	}
+
+	/* All signals are handled by the client, in the main thread */
+	sigfillset(&set);
+	pthread_sigmask(SIG_SETMASK, &set, &old);
+	rc = pthread_create(&refclock_tid, NULL, refclock_thread, NULL);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	if (rc) {
+		ERR(rc, "Failed starting refclock thread");
+		refclock_exit();
+		return -1;
+	}
+	refclock_running = 1;
+	INFO("Reading reference clock %s", spec);
+
+	return 0;
+}
+
+static int cmp(const void *a, const void *b)
+{
+	double x = *(const double *)a, y = *(const double *)b;
+
+	return (x > y) - (x < y);
+}
+
+/*
+ * The median of the samples since the last call, with the time of the
+ * latest, and half the interquartile range as their dispersion.  Returns
+ * 0 on success, -1 if there were no samples.
+ */
+int refclock_poll(struct refclock_sample *rs)
+{
+	double x[REFCLOCK_MAX];
+	unsigned int num;
+
+	pthread_mutex_lock(&samples.lock);
+	num = MIN(samples.num, REFCLOCK_MAX);
+	memcpy(x, samples.offset, num * sizeof(x[0]));
+	rs->arrival = samples.last;
+	samples.num = 0;
+	pthread_mutex_unlock(&samples.lock);
+
+	if (!num)
+		return -1;
+
+	qsort(x, num, sizeof(x[0]), cmp);
+	rs->offset = num & 1 ? x[num / 2] : (x[num / 2 - 1] + x[num / 2]) / 2;
+	rs->disp   = (x[(num * 3) / 4] - x[num / 4]) / 2;
+	rs->num    = num;
+	memcpy(rs->refid, refid, sizeof(rs->refid));
+
+	return 0;
+}
+
+void refclock_exit(void)
+{
+	if (refclock_running) {
+		pthread_cancel(refclock_tid);
+		pthread_join(refclock_tid, NULL);
+		refclock_running = 0;
+	}
+
+	if (shm) {
+		shmdt(shm);
+		shm = NULL;
+	}
+	if (sock_sd != -1) {
+		close(sock_sd);
+		sock_sd = -1;
+	}
+	if (sock_path) {
+		unlink(sock_path);
+		free(sock_path);
+		sock_path = NULL;
+	}
+}
+
+/**
+ * Local Variables:
+ *  indent-tabs-mode: t
+ *  c-file-style: "linux"
+ * End:
+ */
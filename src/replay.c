@@ -0,0 +1,611 @@
+/* Replay of client logs through the phase lock, developer mode
+ *
+ * Copyright (C) 1997-2015  Larry Doolittle <larry@doolittle.boa.org>
+ * Copyright (C) 2010-2022  Joachim Wiberg <troglobit@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License (Version 2,
+ * June 1991) as published by the Free Software Foundation.  At the
+ * time of writing, that license was published by the FSF with the URL
+ * http://www.gnu.org/copyleft/gpl.html, and is incorporated herein by
+ * reference.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+/*
+ * Each input is a log from ntpclient/sntpd, one sample per line:
+ *
+ *     <day> <sec> <el_time> <st_time> <skew> <disp> <freq>
+ *
+ * see docs/test.dat, or a binary capture from sntpd -w, see capture.c.
+ * Files are memory mapped and replayed in parallel, one phase lock
+ * instance per file, one worker thread per online CPU.  Captures are
+ * fed through rfc1305print(), so the packet validation and the offset
+ * calculation are replayed as well, but that code uses the globals of
+ * the client, so only one capture is replayed at a time.
+ * The frequency decisions of the phase lock are applied to a simulated
+ * clock, so the result shows what would have happened had this version
+ * of the code been in control when the log was recorded.
+ *
+ * Convergence time is from the first sample until the frequency last
+ * moved more than CONVERGED ppm away from where it settled.
+ */
+
+#include "config.h"
+#include <fcntl.h>
+#include <math.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "sntpd.h"
+
+#define CONVERGED 1	/* ppm */
+
+struct replay {
+	const char *file;
+	const char *buf;
+	size_t len;
+
+	int rc;			/* 0: OK, 1: system error, 2: input error */
+	int lines;		/* on input error, the failing line */
+	int samples;
+
+	unsigned int first;	/* time of first sample */
+	unsigned int settled;	/* time freq last left the CONVERGED band */
+	int band;		/* freq at start of current band */
+	int freq;		/* last computed freq */
+	double last;		/* last offset */
+	double sum2;		/* sum of squared offsets, for RMS */
+	double diff2;		/* sum of squared offset changes, for jitter */
+	double max;		/* largest absolute offset */
+};
+
+static struct replay *job;
+static int num_jobs;
+static int next_job;
+static const struct phaselock_param *param;
+
+static pthread_mutex_t capture_lock = PTHREAD_MUTEX_INITIALIZER;
+static int capture_freq;	/* virtual kernel frequency, under capture_lock */
+static double capture_step;	/* usec, sum of set_time() calls, ditto */
+
+/* Skip blanks, but not newlines, return NULL at end of buffer */
+static const char *skip(const char *ptr, const char *end)
+{
+	while (ptr < end && (*ptr == ' ' || *ptr == '\t' || *ptr == '\r'))
+		ptr++;
+
+	return ptr < end ? ptr : NULL;
+}
+
+/*
+ * Parse a decimal number with optional sign and fraction, no exponent,
+ * digits beyond nine decimals are ignored.  Much faster than strtod(),
+ * which matters on a year of logs.  Returns pointer to first character
+ * after the number, or NULL on error.
+ */
+static const char *number(const char *ptr, const char *end, double *val)
+{
+	static const double scale[] = { 1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9 };
+	int64_t num = 0;
+	int neg = 0, digits = 0, frac = 0;
+
+	ptr = skip(ptr, end);
+	if (!ptr)
+		return NULL;
+
+	if (*ptr == '-' || *ptr == '+')
+		neg = *ptr++ == '-';
+	for (; ptr < end && *ptr >= '0' && *ptr <= '9'; ptr++, digits++) {
+		if (digits < 18)
+			num = num * 10 + (*ptr - '0');
+		else
+			return NULL;
+	}
+	if (ptr < end && *ptr == '.') {
+		for (ptr++; ptr < end && *ptr >= '0' && *ptr <= '9'; ptr++) {
+			if (digits < 18 && frac < 9) {
+				num = num * 10 + (*ptr - '0');
+				digits++;
+				frac++;
+			}
+		}
+	}
+	if (!digits)
+		return NULL;
+
+	/* exact mantissa and power of ten, so correctly rounded */
+	*val = (neg ? -num : num) / scale[frac];
+
+	return ptr;
+}
+
+/* Parse one line, returns pointer to the next line or NULL on error */
+static const char *parse(const char *ptr, const char *end, double val[7])
+{
+	int i;
+
+	for (i = 0; i < 7; i++) {
+		ptr = number(ptr, end, &val[i]);
+		if (!ptr)
+			return NULL;
+	}
+
+	ptr = skip(ptr, end);
+	if (!ptr)
+		return end;
+	if (*ptr != '\n')
+		return NULL;
+
+	return ptr + 1;
+}
+
+/* Add one sample to the statistics, freq is the new phase lock output */
+static void account(struct replay *r, unsigned int absolute, double skew, int freq)
+{
+	if (abs(freq - r->band) > CONVERGED * 65536) {
+		r->band    = freq;
+		r->settled = absolute;
+	}
+	r->freq = freq;
+	r->sum2 += skew * skew;
+	if (r->samples)
+		r->diff2 += (skew - r->last) * (skew - r->last);
+	r->last = skew;
+	if (fabs(skew) > r->max)
+		r->max = fabs(skew);
+	r->samples++;
+}
+
+static void text_run(struct replay *r, struct phaselock *pl)
+{
+	const char *ptr = r->buf, *end = r->buf + r->len;
+	unsigned int absolute, last_fake_time = 0;
+	double fake_delta_time = 0.0;
+	int simulated_freq = 0;
+
+	while (ptr < end) {
+		double val[7], skew, errorbar;
+		int freq;
+
+		r->lines++;
+		ptr = parse(ptr, end, val);
+		if (!ptr) {
+			r->rc = 2;
+			return;
+		}
+
+		absolute = (int)val[0] * 86400 + (int)val[1];
+		errorbar = val[2] + val[5];
+		skew     = val[4];
+		freq     = (int)val[6];
+
+		if (last_fake_time == 0) {
+			simulated_freq = freq;
+			r->first = r->settled = absolute;
+			r->band  = freq;
+		}
+		fake_delta_time += (absolute - last_fake_time) * ((double)(freq - simulated_freq)) / 65536;
+		skew += fake_delta_time;
+		last_fake_time = absolute;
+		simulated_freq = phaselock_feed(pl, absolute, skew, errorbar, simulated_freq);
+		account(r, absolute, skew, simulated_freq);
+	}
+}
+
+static int capture_get_freq(void)
+{
+	return capture_freq;
+}
+
+static int capture_set_freq(int freq)
+{
+	capture_freq = freq;
+	return 0;
+}
+
+static int capture_set_time(double offset, int threshold)
+{
+	(void)threshold;
+	capture_step += offset;
+	return 0;
+}
+
+static const struct clock_ops capture_ops = {
+	.get_freq = capture_get_freq,
+	.set_freq = capture_set_freq,
+	.set_time = capture_set_time,
+};
+
+static void ntohtime(struct ntptime *nt, const uint32_t *data)
+{
+	nt->coarse = ntohl(data[0]);
+	nt->fine   = ntohl(data[1]);
+}
+
+/* Move a local timestamp usec microseconds */
+static void shift(struct ntptime *nt, double usec)
+{
+	uint64_t t = (uint64_t)nt->coarse << 32 | nt->fine;
+
+	t += (uint64_t)llround(usec * 4294.967296);
+	nt->coarse = t >> 32;
+	nt->fine   = t & 0xffffffff;
+}
+
+/* Microseconds from a to b */
+static double elapsed(const struct ntptime *a, const struct ntptime *b)
+{
+	uint64_t ta = (uint64_t)a->coarse << 32 | a->fine;
+	uint64_t tb = (uint64_t)b->coarse << 32 | b->fine;
+
+	return (int64_t)(tb - ta) / 4294.967296;
+}
+
+/*
+ * Replay a capture through rfc1305print().  As in text_run(), the local
+ * clock is moved by what the phase lock would have done differently
+ * from the recorded kernel frequency, here by shifting T1 and T4.
+ */
+static void capture_run(struct replay *r, struct phaselock *pl)
+{
+	const struct capture_hdr *hdr = (const struct capture_hdr *)r->buf;
+	struct phaselock *saved;
+	struct ntp_control ntpc;
+	unsigned int absolute, last_fake_time = 0;
+	double fake_delta_time = 0.0;
+	size_t reclen, num, i;
+
+	reclen = ntohl(hdr->reclen);
+	if (reclen < sizeof(struct capture_rec)) {
+		r->rc = 2;
+		return;
+	}
+	num = (r->len - sizeof(*hdr)) / reclen;
+
+	memset(&ntpc, 0, sizeof(ntpc));
+	ntpc.live        = 1;
+	ntpc.cross_check = 1;
+
+	pthread_mutex_lock(&capture_lock);
+	saved   = peer.pl;
+	peer.pl = pl;
+	filter_reset(&peer.filter);
+	capture_step = 0.0;
+	clock_override(&capture_ops);
+
+	for (i = 0; i < num; i++) {
+		struct ntptime t1, t2, t3, t4;
+		struct capture_rec rec;
+		int freq, error;
+		double skew;
+
+		r->lines = i + 1;
+		memcpy(&rec, r->buf + sizeof(*hdr) + i * reclen, sizeof(rec));
+		ntohtime(&t1, &rec.t1.coarse);
+		ntohtime(&t4, &rec.t4.coarse);
+		freq     = (int32_t)ntohl(rec.freq);
+		absolute = t4.coarse;
+
+		if (last_fake_time == 0) {
+			capture_freq = freq;
+			r->first = r->settled = absolute;
+			r->band  = freq;
+		}
+		fake_delta_time += (absolute - last_fake_time) * ((double)(freq - capture_freq)) / 65536;
+		last_fake_time = absolute;
+
+		shift(&t1, capture_step - fake_delta_time);
+		shift(&t4, capture_step - fake_delta_time);
+		rec.data[6] = htonl(t1.coarse);
+		rec.data[7] = htonl(t1.fine);
+		ntpc.time_of_send = t1;
+
+		if (rfc1305print(rec.data, &t4, &ntpc, &error))
+			continue;	/* rejected, logged by rfc1305print() */
+
+		ntohtime(&t2, &rec.data[8]);
+		ntohtime(&t3, &rec.data[10]);
+		skew = (elapsed(&t1, &t2) + elapsed(&t4, &t3)) / 2;
+		account(r, absolute, skew, capture_freq);
+	}
+
+	clock_override(NULL);
+	peer.pl = saved;
+	pthread_mutex_unlock(&capture_lock);
+}
+
+static int is_capture(struct replay *r)
+{
+	return r->len >= sizeof(struct capture_hdr) &&
+		!memcmp(r->buf, CAPTURE_MAGIC, sizeof(((struct capture_hdr *)0)->magic));
+}
+
+static void replay_run(struct replay *r, struct phaselock *pl)
+{
+	r->rc = r->lines = r->samples = 0;
+	r->sum2 = r->diff2 = r->max = 0.0;
+	phaselock_reset(pl);
+
+	if (is_capture(r))
+		capture_run(r, pl);
+	else
+		text_run(r, pl);
+}
+
+static void *worker(void *arg)
+{
+	struct phaselock *pl;
+	int i;
+
+	(void)arg;
+	pl = phaselock_create(param->window);
+	if (!pl) {
+		ERR(errno, "Failed creating phase lock");
+		return NULL;
+	}
+	phaselock_param(pl, param);
+	trace_subscribe(pl);
+
+	while ((i = __atomic_fetch_add(&next_job, 1, __ATOMIC_RELAXED)) < num_jobs) {
+		if (job[i].rc)
+			continue;	/* failed to open */
+		replay_run(&job[i], pl);
+	}
+	phaselock_destroy(pl);
+
+	return NULL;
+}
+
+/* Map file to memory, an empty file is fine, stdin is read instead */
+static int replay_open(struct replay *r)
+{
+	struct stat st;
+	char *buf = NULL;
+	size_t len = 0, sz = 0;
+	ssize_t n;
+	int fd;
+
+	if (strcmp(r->file, "-")) {
+		fd = open(r->file, O_RDONLY);
+		if (fd == -1)
+			goto fail;
+		if (fstat(fd, &st)) {
+			close(fd);
+			goto fail;
+		}
+
+		r->len = st.st_size;
+		if (r->len > 0) {
+			r->buf = mmap(NULL, r->len, PROT_READ, MAP_PRIVATE, fd, 0);
+			if (r->buf == MAP_FAILED) {
+				r->buf = NULL;
+				close(fd);
+				goto fail;
+			}
+			madvise((void *)r->buf, r->len, MADV_SEQUENTIAL);
+		}
+		close(fd);
+
+		return 0;
+	}
+
+	do {
+		if (len == sz) {
+			char *tmp;
+
+			sz  = sz ? sz * 2 : 65536;
+			tmp = realloc(buf, sz);
+			if (!tmp) {
+				free(buf);
+				goto fail;
+			}
+			buf = tmp;
+		}
+		n = read(STDIN_FILENO, buf + len, sz - len);
+		if (n > 0)
+			len += n;
+	} while (n > 0 || (n == -1 && errno == EINTR));
+
+	r->buf = buf;
+	r->len = len;
+	if (n == -1)
+		goto fail;
+
+	return 0;
+fail:
+	ERR(errno, "Failed reading %s", r->file);
+	r->rc = 1;
+
+	return -1;
+}
+
+static void replay_close(struct replay *r)
+{
+	if (!r->buf)
+		return;
+
+	if (strcmp(r->file, "-"))
+		munmap((void *)r->buf, r->len);
+	else
+		free((void *)r->buf);
+}
+
+static double rms(struct replay *r)
+{
+	return r->samples ? sqrt(r->sum2 / r->samples) : 0.0;
+}
+
+static double jitter(struct replay *r)
+{
+	return r->samples > 1 ? sqrt(r->diff2 / (r->samples - 1)) : 0.0;
+}
+
+/* Open logs to replay, stdin if none, see replay_run() */
+int replay_load(int argc, char *argv[])
+{
+	static char dash[] = "-";
+	static char *stdin_arg[] = { dash };
+	int i;
+
+	if (argc < 1) {
+		argc = 1;
+		argv = stdin_arg;
+	}
+
+	job = calloc(argc, sizeof(*job));
+	if (!job) {
+		ERR(errno, "Failed allocating replay jobs");
+		return -1;
+	}
+	num_jobs = argc;
+
+	for (i = 0; i < argc; i++) {
+		job[i].file = argv[i];
+		replay_open(&job[i]);
+	}
+
+	return 0;
+}
+
+void replay_unload(void)
+{
+	int i;
+
+	for (i = 0; i < num_jobs; i++)
+		replay_close(&job[i]);
+	free(job);
+	job = NULL;
+	num_jobs = 0;
+}
+
+/* Replay all loaded logs with the given phase lock parameters */
+static void replay_all(const struct phaselock_param *p)
+{
+	pthread_t *tid;
+	long ncpu;
+	int i, num;
+
+	param    = p;
+	next_job = 0;
+
+	ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+	if (ncpu < 1)
+		ncpu = 1;
+	if (ncpu > num_jobs)
+		ncpu = num_jobs;
+	if (trace_active())
+		ncpu = 1;	/* keep trace records in file order */
+
+	tid = calloc(ncpu, sizeof(*tid));
+	if (!tid) {
+		ERR(errno, "Failed allocating replay threads");
+		ncpu = 0;
+	}
+
+	for (num = 0; num < ncpu; num++) {
+		errno = pthread_create(&tid[num], NULL, worker, NULL);
+		if (errno) {
+			ERR(errno, "Failed starting replay thread");
+			break;
+		}
+	}
+	if (num == 0)
+		worker(NULL);	/* fall back to replay in this thread */
+	for (i = 0; i < num; i++)
+		pthread_join(tid[i], NULL);
+	free(tid);
+}
+
+/*
+ * Score a parameter set on the loaded logs, mean convergence time and
+ * RMS of offset change per sample.  Returns -1 if no log could be used.
+ */
+int replay_score(const struct phaselock_param *p, struct score *sc)
+{
+	double conv = 0.0, diff2 = 0.0;
+	int i, files = 0, samples = 0;
+
+	replay_all(p);
+	for (i = 0; i < num_jobs; i++) {
+		struct replay *r = &job[i];
+
+		if (r->rc || r->samples < 2)
+			continue;
+
+		files++;
+		samples += r->samples - 1;
+		conv    += r->settled - r->first;
+		diff2   += r->diff2;
+	}
+
+	if (!files)
+		return -1;
+
+	sc->lock   = conv / files;
+	sc->jitter = sqrt(diff2 / samples);
+
+	return 0;
+}
+
+/*
+ * Replay logs given as arguments, or stdin if none.  Prints results
+ * per file and in aggregate to stdout.  Returns 0 if all logs were
+ * replayed, 1 on system error, and 2 on input error.
+ */
+int replay(int argc, char *argv[])
+{
+	int i, rc = 0;
+	int files = 0, samples = 0;
+	double freq = 0.0, offset = 0.0, max = 0.0, conv = 0.0, max_conv = 0.0;
+
+	if (replay_load(argc, argv))
+		return 1;
+	replay_all(&phaselock_defaults);
+
+	printf("%-24s %8s %10s %10s %10s %10s %9s\n", "# file", "samples",
+	       "freq/ppm", "rms/us", "max/us", "jitter/us", "conv/s");
+	for (i = 0; i < num_jobs; i++) {
+		struct replay *r = &job[i];
+
+		if (r->rc == 2)
+			ERR(0, "%s:%d: replay input error", r->file, r->lines);
+		if (r->rc > rc)
+			rc = r->rc;
+		if (r->rc || !r->samples)
+			continue;
+
+		printf("%-24s %8d %10.3f %10.1f %10.1f %10.1f %9u\n", r->file, r->samples,
+		       r->freq / 65536.0, rms(r), r->max, jitter(r), r->settled - r->first);
+
+		files++;
+		samples += r->samples;
+		freq    += r->freq / 65536.0;
+		offset  += r->sum2;
+		if (r->max > max)
+			max = r->max;
+		conv += r->settled - r->first;
+		if (r->settled - r->first > max_conv)
+			max_conv = r->settled - r->first;
+	}
+
+	if (files > 1) {
+		printf("# %d files, %d samples, mean freq %.3f ppm, rms %.1f us, max %.1f us\n",
+		       files, samples, freq / files, sqrt(offset / samples), max);
+		printf("# convergence mean %.0f s, max %.0f s\n", conv / files, max_conv);
+	}
+	replay_unload();
+
+	return rc;
+}
+
+/**
+ * Local Variables:
+ *  indent-tabs-mode: t
+ *  c-file-style: "linux"
+ * End:
+ */
@@ -1,16 +1,56 @@
+#include <pthread.h>
+#include <signal.h>
 #include "sntpd.h"
 
-int server_init(uint16_t port)
+/*
+ * The server runs in a thread of its own, so a flood of requests never
+ * delays reading the reply from our upstream server.  The client side
+ * publishes the reference state with server_update(), the server reads
+ * a consistent copy of it without locking using a seqlock: the writer
+ * bumps the sequence number to odd before updating and back to even
+ * after, readers retry if it was odd or changed while they copied.
+ */
+static struct {
+	unsigned int seq;
+	struct ntp_ref ref;
+} snapshot;
+
+static pthread_t server_tid;
+static int server_sd = -1;
+static struct server_stats stats;
+
+/* Counters for metrics.c, the server thread is the only writer */
+void server_stats(struct server_stats *ss)
 {
-	int sd;
+	ss->requests = __atomic_load_n(&stats.requests, __ATOMIC_RELAXED);
+	ss->replies  = __atomic_load_n(&stats.replies,  __ATOMIC_RELAXED);
+	ss->drops    = __atomic_load_n(&stats.drops,    __ATOMIC_RELAXED);
+}
 
-	sd = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
-	if (sd == -1)
-		return -1;
+static void count(unsigned long *counter)
+{
+	__atomic_store_n(counter, *counter + 1, __ATOMIC_RELAXED);
+}
 
-	setup_receive(sd, AF_INET, port);
+void server_update(const struct ntp_ref *ref)
+{
+	unsigned int seq = __atomic_load_n(&snapshot.seq, __ATOMIC_RELAXED);
 
-	return sd;
+	__atomic_store_n(&snapshot.seq, seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	snapshot.ref = *ref;
+	__atomic_store_n(&snapshot.seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+static void server_reference(struct ntp_ref *ref)
+{
+	unsigned int seq;
+
+	do {
+		seq = __atomic_load_n(&snapshot.seq, __ATOMIC_ACQUIRE);
+		*ref = snapshot.ref;
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	} while ((seq & 1) || seq != __atomic_load_n(&snapshot.seq, __ATOMIC_RELAXED));
 }
 
 static int validate_request(char *buf, size_t len)
@@ -47,63 +87,130 @@ static int validate_request(char *buf, size_t len)
 	return 0;
 }
 
-static size_t compose_reply(struct ntp *ntp, size_t len)
+static size_t compose_reply(struct ntp *ntp, struct ntp_ref *ref)
 {
 	char id[] = "LOCL";
 
 	/* li:0, version:3, mode:4 (server) */
 	ntp->flags = 0 << 6 | 3 << 3 | 4 << 0 ;
 
-	ntp->stratum = 1;
+	ntp->stratum = ref->stratum ?: 1;
 	ntp->interval = 4;	/* 16 s */
 	ntp->precision = G_precision_exp;
 
 	/* root delay and rooty dispersion */
-	ntp->delay      = u2sec(root_delay);
-	ntp->dispersion = u2sec(root_dispersion);
+	ntp->delay      = u2sec(ref->root_delay);
+	ntp->dispersion = u2sec(ref->root_dispersion);
 
-	memcpy(ntp->identifier, id, sizeof(ntp->identifier));
+	if (ref->refid[0])
+		memcpy(ntp->identifier, ref->refid, sizeof(ntp->identifier));
+	else
+		memcpy(ntp->identifier, id, sizeof(ntp->identifier));
 
 	return sizeof(*ntp);
 }
 
-int server_recv(int sd)
+static int server_recv(int sd)
 {
 	struct sockaddr_storage ss;
 	struct ntptime recv_ts, xmit_ts;
+	struct ntp_ref ref;
 	struct ntp *ntp;
 	socklen_t ss_len;
 	ssize_t num;
 	char buf[128];
 
+	/* Only allow server_exit() to cancel us while we wait for requests */
 	ss_len = sizeof(struct sockaddr_storage);
+	pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
 	num = recvfrom(sd, buf, sizeof(buf) - 1, 0, (struct sockaddr *)&ss, &ss_len);
+	pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
 	if (num == -1)
 		return -1;
 
+	count(&stats.requests);
 	get_packet_timestamp(sd, &recv_ts);
+	PROBE(server_request, recv_ts.coarse, recv_ts.fine, num);
 	if (validate_request(buf, num)) {
 		DBG("Validation failed");
+		count(&stats.drops);
+		PROBE(server_drop, recv_ts.coarse, recv_ts.fine, num);
 		return -1;
 	}
 
 	/* Compose NTP message reply */
+	server_reference(&ref);
 	ntp = (struct ntp *)buf;
-	num = compose_reply(ntp, sizeof(*ntp));
+	num = compose_reply(ntp, &ref);
 
 	memcpy(&ntp->origin_ts, &ntp->xmit_ts, sizeof(ntp->origin_ts));
 
 	ntp->recv_ts.coarse   = htonl(recv_ts.coarse);
 	ntp->recv_ts.fine     = htonl(recv_ts.fine);
 
-	ntp->refclk_ts.coarse = htonl(peer.last_update_ts.coarse);
-	ntp->refclk_ts.fine   = htonl(peer.last_update_ts.fine);
+	ntp->refclk_ts.coarse = htonl(ref.refclk_ts.coarse);
+	ntp->refclk_ts.fine   = htonl(ref.refclk_ts.fine);
 
 	ntpc_gettime(&xmit_ts);
 	ntp->xmit_ts.coarse = htonl(xmit_ts.coarse);
 	ntp->xmit_ts.fine   = htonl(xmit_ts.fine);
 
-	return sendto(sd, buf, num, 0, (struct sockaddr *)&ss, ss_len);
+	num = sendto(sd, buf, num, 0, (struct sockaddr *)&ss, ss_len);
+	count(num == -1 ? &stats.drops : &stats.replies);
+	PROBE(server_reply, xmit_ts.coarse, xmit_ts.fine, num);
+
+	return num;
+}
+
+static void *server_thread(void *arg)
+{
+	int sd = *(int *)arg;
+
+	pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+	while (1)
+		server_recv(sd);
+
+	return NULL;
+}
+
+int server_init(uint16_t port)
+{
+	sigset_t set, old;
+	int rc;
+
+	server_sd = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+	if (server_sd == -1)
+		return -1;
+
+	if (setup_receive(server_sd, AF_INET, port))
+		goto fail;
+
+	/* All signals are handled by the client, in the main thread */
+	sigfillset(&set);
+	pthread_sigmask(SIG_SETMASK, &set, &old);
+	rc = pthread_create(&server_tid, NULL, server_thread, &server_sd);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	if (rc) {
+		ERR(rc, "Failed starting server thread");
+		goto fail;
+	}
+
+	return 0;
+fail:
+	close(server_sd);
+	server_sd = -1;
+	return -1;
+}
+
+void server_exit(void)
+{
+	if (server_sd == -1)
+		return;
+
+	pthread_cancel(server_tid);
+	pthread_join(server_tid, NULL);
+	close(server_sd);
+	server_sd = -1;
 }
 
 /**
@@ -0,0 +1,387 @@
+/* Oscillator and network simulator, developer mode
+ *
+ * Copyright (C) 2010-2022  Joachim Wiberg <troglobit@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License (Version 2,
+ * June 1991) as published by the Free Software Foundation.  At the
+ * time of writing, that license was published by the FSF with the URL
+ * http://www.gnu.org/copyleft/gpl.html, and is incorporated herein by
+ * reference.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+/*
+ * Runs the real client code, rfc1305print() and the phase lock, against
+ * a virtual clock and a perfect server, no sockets, no waiting.  The
+ * local oscillator has a fixed frequency error, random walk wander, and
+ * temperature steps that toggle every period.  Each poll the packet is
+ * delayed a fixed minimum plus exponentially distributed queueing, in
+ * each direction, possibly asymmetric, or lost.
+ *
+ * Everything is driven by one pseudo random generator, so a given seed
+ * and set of parameters always gives the same result.  Reported:
+ *
+ *   lock/s  time until the true offset stayed within the lock limit,
+ *           -1 if it never did
+ *   rms/us  RMS of the true offset over the second half of the run,
+ *   max/us  and the largest true offset there
+ *   freq    remaining frequency error at the end, in ppm
+ */
+
+#include "config.h"
+#include <math.h>
+#include "sntpd.h"
+
+struct sim {
+	uint64_t seed;		/* pseudo random generator seed */
+	int    polls;		/* number of polls to run */
+	double freq;		/* oscillator frequency error, ppm */
+	double wander;		/* random walk, ppm/sqrt(s) */
+	double temp;		/* temperature step, ppm */
+	double period;		/* time between temperature steps, s */
+	double offset;		/* initial phase offset, usec */
+	double delay;		/* minimum round-trip delay, usec */
+	double jitter;		/* mean queueing delay, each way, usec */
+	double asym;		/* -1..1, share of minimum delay outbound */
+	double loss;		/* 0..1, probability a poll is lost */
+	double outage;		/* s, server gone from mid run */
+	double stall;		/* server processing time, usec */
+	double lock;		/* lock limit, usec */
+
+	uint64_t rng;		/* pseudo random generator state */
+	double t;		/* true time since start, s */
+	double mid;		/* s, start of outage */
+	double x;		/* local clock minus true time, s */
+	double rw;		/* random walk part of frequency error, ppm */
+	int    kfreq;		/* kernel frequency, ppm * 65536 */
+};
+
+static struct sim sim = {
+	.seed   = 1,
+	.polls  = 100000,
+	.freq   = 50.0,
+	.wander = 1e-4,
+	.temp   = 0.0,
+	.period = 43200,
+	.offset = 0.0,
+	.delay  = 1000.0,
+	.jitter = 100.0,
+	.asym   = 0.0,
+	.loss   = 0.0,
+	.outage = 0.0,
+	.stall  = 50.0,
+	.lock   = 1000.0,
+};
+
+/* Start of simulation, NTP seconds, 2023-10-19 */
+#define EPOCH 3906662400U
+
+/* xorshift64*, small, fast, and good enough for this */
+static uint64_t rnd(void)
+{
+	sim.rng ^= sim.rng >> 12;
+	sim.rng ^= sim.rng << 25;
+	sim.rng ^= sim.rng >> 27;
+
+	return sim.rng * 2685821657736338717ULL;
+}
+
+/* Uniform (0, 1), never zero */
+static double uniform(void)
+{
+	return ((rnd() >> 11) + 0.5) / 9007199254740992.0;
+}
+
+static double gauss(void)
+{
+	return sqrt(-2.0 * log(uniform())) * cos(2 * M_PI * uniform());
+}
+
+static double expo(double mean)
+{
+	return -mean * log(uniform());
+}
+
+static int sim_get_freq(void)
+{
+	return sim.kfreq;
+}
+
+static int sim_set_freq(int freq)
+{
+	sim.kfreq = freq;
+	return 0;
+}
+
+static int sim_set_time(double offset, int threshold)
+{
+	(void)threshold;	/* slews are instant here */
+	sim.x += offset / 1e6;
+	return 0;
+}
+
+static const struct clock_ops sim_ops = {
+	.get_freq = sim_get_freq,
+	.set_freq = sim_set_freq,
+	.set_time = sim_set_time,
+};
+
+/* Current frequency error of the local clock, ppm */
+static double drift(void)
+{
+	double temp = 0.0;
+
+	if (sim.temp != 0.0 && ((long)(sim.t / sim.period) & 1))
+		temp = sim.temp;
+
+	return sim.freq + sim.rw + temp + sim.kfreq / 65536.0;
+}
+
+static struct ntptime ntptime(double t)
+{
+	struct ntptime nt;
+	double sec = floor(t);
+
+	nt.coarse = EPOCH + (uint32_t)sec;
+	nt.fine   = (uint32_t)((t - sec) * 4294967296.0);
+
+	return nt;
+}
+
+/* One poll of the perfect server, returns 0 if the reply was lost */
+static int exchange(struct ntp_control *ntpc, uint32_t *data, struct ntptime *arrival)
+{
+	double out, in, t2, t3, t4;
+	struct ntptime nt;
+
+	out = sim.delay * (1 + sim.asym) / 2 + expo(sim.jitter);
+	in  = sim.delay * (1 - sim.asym) / 2 + expo(sim.jitter);
+	if (uniform() < sim.loss)
+		return 0;
+	if (sim.t >= sim.mid && sim.t < sim.mid + sim.outage)
+		return 0;
+
+	t2 = sim.t + out / 1e6;
+	t3 = t2 + sim.stall / 1e6;
+	t4 = t3 + in / 1e6;
+
+	ntpc->time_of_send = ntptime(sim.t + sim.x);
+	*arrival = ntptime(t4 + sim.x);
+
+	memset(data, 0, 48);
+	data[0] = htonl((0 << 30) | (4 << 27) | (4 << 24) | (1 << 16) | (G_precision_exp & 0xff));
+	data[6] = htonl(ntpc->time_of_send.coarse);
+	data[7] = htonl(ntpc->time_of_send.fine);
+	nt = ntptime(t2);
+	data[8] = htonl(nt.coarse);
+	data[9] = htonl(nt.fine);
+	nt = ntptime(t3);
+	data[10] = htonl(nt.coarse);
+	data[11] = htonl(nt.fine);
+
+	return 1;
+}
+
+/* Parse simulator SPEC, comma separated list of key=value */
+int sim_setup(char *spec)
+{
+	struct {
+		const char *key;
+		double *val;
+	} param[] = {
+		{ "freq",   &sim.freq   },
+		{ "wander", &sim.wander },
+		{ "temp",   &sim.temp   },
+		{ "period", &sim.period },
+		{ "offset", &sim.offset },
+		{ "delay",  &sim.delay  },
+		{ "jitter", &sim.jitter },
+		{ "asym",   &sim.asym   },
+		{ "loss",   &sim.loss   },
+		{ "outage", &sim.outage },
+		{ "stall",  &sim.stall  },
+		{ "lock",   &sim.lock   },
+	};
+	char *key, *value;
+	size_t i;
+
+	while ((key = strsep(&spec, ","))) {
+		if (!*key)
+			continue;
+
+		value = strchr(key, '=');
+		if (!value) {
+			ERR(0, "Missing value for simulator parameter %s", key);
+			return -1;
+		}
+		*value++ = 0;
+
+		if (!strcmp(key, "seed")) {
+			sim.seed = strtoull(value, NULL, 0);
+			continue;
+		}
+		if (!strcmp(key, "polls")) {
+			sim.polls = atoi(value);
+			continue;
+		}
+		if (!strcmp(key, "window")) {
+			char buf[32];
+
+			/* same as -T window=, validated there */
+			snprintf(buf, sizeof(buf), "window=%s", value);
+			if (phaselock_tune(&phaselock_defaults, buf))
+				return -1;
+			continue;
+		}
+
+		for (i = 0; i < (sizeof(param) / sizeof(param[0])); i++) {
+			if (!strcmp(key, param[i].key)) {
+				*param[i].val = atof(value);
+				break;
+			}
+		}
+		if (i == (sizeof(param) / sizeof(param[0]))) {
+			ERR(0, "Unknown simulator parameter %s", key);
+			return -1;
+		}
+	}
+
+	if (!sim.seed)
+		sim.seed = 1;	/* xorshift is stuck at zero */
+	if (sim.period <= 0)
+		sim.period = 1;
+
+	return 0;
+}
+
+/* Outcome of one run */
+struct result {
+	int    lost;
+	double lock;		/* s, -1 if never */
+	double rms;		/* us, second half */
+	double max;		/* us, second half */
+	double freq;		/* ppm, remaining error */
+};
+
+static int sim_run(struct ntp_control *ntpc, const struct phaselock_param *param, struct result *res)
+{
+	int i, samples = 0, error_bar;
+	double sum2 = 0.0, locked = 0.0;
+	uint32_t data[12];
+
+	peer.pl = phaselock_create(param->window);
+	if (!peer.pl) {
+		ERR(errno, "Failed creating phase lock");
+		return -1;
+	}
+	phaselock_param(peer.pl, param);
+	trace_subscribe(peer.pl);
+	filter_reset(&peer.filter);
+
+	ntpc->live        = 1;
+	ntpc->set_clock   = 0;
+	ntpc->kernel_pll  = 0;
+	ntpc->cross_check = 1;
+	if (ntpc->cycle_time < 1)
+		ntpc->cycle_time = 1;
+
+	sim.rng   = sim.seed;
+	sim.t     = sim.rw = 0.0;
+	sim.x     = sim.offset / 1e6;
+	sim.kfreq = 0;
+	sim.mid   = (double)(sim.polls / 2) * ntpc->cycle_time;
+	peer.last_reply = peer.holdover = 0;
+	clock_override(&sim_ops);
+
+	memset(res, 0, sizeof(*res));
+	for (i = 0; i < sim.polls; i++) {
+		struct ntptime arrival;
+		double dt = ntpc->cycle_time, abs_x;
+
+		if (exchange(ntpc, data, &arrival)) {
+			capture_write(data, &ntpc->time_of_send, &arrival, sim.kfreq);
+			rfc1305print(data, &arrival, ntpc, &error_bar);
+		} else {
+			res->lost++;
+			holdover(ntpc, ntptime(sim.t + sim.x).coarse);
+		}
+
+		/* on to the next poll, the oscillator drifts meanwhile */
+		sim.x  += drift() * 1e-6 * dt;
+		sim.rw += sim.wander * sqrt(dt) * gauss();
+		sim.t  += dt;
+
+		abs_x = fabs(sim.x) * 1e6;
+		if (abs_x > sim.lock)
+			locked = sim.t;
+		if (i >= sim.polls / 2) {
+			sum2 += abs_x * abs_x;
+			if (abs_x > res->max)
+				res->max = abs_x;
+			samples++;
+		}
+	}
+
+	clock_override(NULL);
+	phaselock_destroy(peer.pl);
+	peer.pl = NULL;
+
+	res->lock = locked >= sim.t ? -1.0 : locked;
+	res->rms  = samples ? sqrt(sum2 / samples) : 0.0;
+	res->freq = drift();
+
+	return 0;
+}
+
+/* Score a parameter set, time to lock and RMS offset, see sim_setup() */
+int sim_score(struct ntp_control *ntpc, const struct phaselock_param *param, struct score *sc)
+{
+	struct result res;
+
+	if (sim_run(ntpc, param, &res))
+		return -1;
+
+	sc->lock   = res.lock;
+	sc->jitter = res.rms;
+
+	return 0;
+}
+
+/*
+ * Run the simulator, spec is a comma separated list of key=value, see
+ * the man page.  The poll interval and phase lock parameters are taken
+ * from the usual options, with -w the replies are also captured.
+ * Prints result to stdout, returns non-zero on error.
+ */
+int simulate(struct ntp_control *ntpc, char *spec)
+{
+	struct result res;
+	int rc;
+
+	if (sim_setup(spec) || capture_open(ntpc->capture_file))
+		return 1;
+	rc = sim_run(ntpc, &phaselock_defaults, &res);
+	capture_close();
+	if (rc)
+		return 1;
+
+	printf("%-8s %8s %8s %10s %10s %10s %10s\n", "# seed", "polls", "lost",
+	       "lock/s", "rms/us", "max/us", "freq/ppm");
+	printf("%-8llu %8d %8d %10.0f %10.1f %10.1f %10.3f\n",
+	       (unsigned long long)sim.seed, sim.polls, res.lost, res.lock,
+	       res.rms, res.max, res.freq);
+
+	return 0;
+}
+
+/**
+ * Local Variables:
+ *  indent-tabs-mode: t
+ *  c-file-style: "linux"
+ * End:
+ */
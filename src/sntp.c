@@ -0,0 +1,229 @@
+/* libsntp, embeddable SNTP client with a non-blocking API
+ *
+ * Copyright (C) 2010-2022  Joachim Wiberg <troglobit@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License (Version 2,
+ * June 1991) as published by the Free Software Foundation.  At the
+ * time of writing, that license was published by the FSF with the URL
+ * http://www.gnu.org/copyleft/gpl.html, and is incorporated herein by
+ * reference.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+/*
+ * The same building blocks as loop() and rfc1305print() in sntpd, but
+ * driven by the caller: sntp_process() reads whatever replies are
+ * queued on the non-blocking socket, and sends the next request when
+ * it is due, sntp_timeout() tells when that is.  Only a reply to the
+ * outstanding request, passing the RFC-4330 checks, becomes a sample.
+ *
+ * The phase lock needs the frequency correction in effect when each
+ * sample was taken.  It is 0 unless the caller applies the suggested
+ * correction, e.g. with adjtimex(), and reports it with sntp_freq().
+ */
+
+#include "config.h"
+#include <fcntl.h>
+#include "sntpd.h"
+#include "sntp.h"
+
+struct sntp {
+	int sd;
+	int poll;			/* sec */
+	int freq;			/* ppm * 65536, in effect */
+	int pending;			/* request sent, no reply yet */
+	struct timespec next;		/* CLOCK_MONOTONIC, next request */
+	struct ntptime sent;		/* transmit time of that request */
+	struct ntp_filter filter;
+	struct phaselock *pl;
+};
+
+/*
+ * Create a client for the server at sa, polling every poll seconds,
+ * the first request is sent on the first sntp_process().  Returns NULL
+ * on error, with errno set.
+ */
+struct sntp *sntp_open(const struct sockaddr *sa, socklen_t len, int poll)
+{
+	struct sntp *s;
+	int err;
+
+	if (!sa || poll < 1) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	s = calloc(1, sizeof(*s));
+	if (!s)
+		return NULL;
+
+	s->sd = socket(sa->sa_family, SOCK_DGRAM, 0);
+	if (s->sd == -1)
+		goto fail;
+	if (fcntl(s->sd, F_SETFL, O_NONBLOCK) || fcntl(s->sd, F_SETFD, FD_CLOEXEC))
+		goto fail;
+	if (connect(s->sd, sa, len))
+		goto fail;
+
+	s->pl = phaselock_create(phaselock_defaults.window);
+	if (!s->pl)
+		goto fail;
+
+	filter_reset(&s->filter);
+	s->poll = poll;
+	clock_gettime(CLOCK_MONOTONIC, &s->next);
+
+	return s;
+fail:
+	err = errno;
+	sntp_close(s);
+	errno = err;
+
+	return NULL;
+}
+
+void sntp_close(struct sntp *s)
+{
+	if (!s)
+		return;
+
+	if (s->sd != -1)
+		close(s->sd);
+	phaselock_destroy(s->pl);
+	free(s);
+}
+
+/* Socket to wait on for reading */
+int sntp_fd(const struct sntp *s)
+{
+	return s->sd;
+}
+
+/* Milliseconds until sntp_process() must be called again, at the latest */
+int sntp_timeout(const struct sntp *s)
+{
+	struct timespec now;
+	long long msec;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	msec = (s->next.tv_sec - now.tv_sec) * 1000LL + (s->next.tv_nsec - now.tv_nsec) / 1000000;
+	if (msec < 0)
+		return 0;
+
+	return msec + 1;
+}
+
+/*
+ * Phase lock window, the number of samples it decides from, default 16.
+ * A larger window rides out more network noise but locks slower.  The
+ * phase lock starts over.  Returns 0, or -1 with errno set.
+ */
+int sntp_window(struct sntp *s, int window)
+{
+	struct phaselock *pl;
+
+	pl = phaselock_create(window);
+	if (!pl)
+		return -1;
+
+	phaselock_destroy(s->pl);
+	s->pl = pl;
+
+	return 0;
+}
+
+/* Frequency correction in effect, in ppm, e.g. after applying sample.freq */
+void sntp_freq(struct sntp *s, double ppm)
+{
+	s->freq = ppm * 65536;
+}
+
+static void sntp_sample(struct sntp *s, const struct ntp_reply *r, const struct ntptime *arrival,
+			struct sntp_sample *sample)
+{
+	int new_freq;
+
+	filter_add(&s->filter, arrival->coarse, r->offset, r->el_time - r->st_time);
+	new_freq = phaselock_feed(s->pl, arrival->coarse, r->offset, r->el_time + sec2u(r->disp), s->freq);
+
+	sample->time.tv_sec     = arrival->coarse - JAN_1970;
+	sample->time.tv_nsec    = USEC(arrival->fine) * 1000L;
+	sample->offset          = r->offset / 1e6;
+	sample->delay           = (r->el_time - r->st_time) / 1e6;
+	sample->root_delay      = r->root_delay;
+	sample->root_dispersion = r->root_dispersion;
+	sample->stratum         = r->stratum;
+	sample->leap            = r->li;
+	sample->filtered        = s->filter.offset / 1e6;
+	sample->jitter          = s->filter.jitter / 1e6;
+	sample->freq            = new_freq / 65536.0;
+}
+
+/*
+ * Call when sntp_fd() is readable or sntp_timeout() has passed.  Returns
+ * 1 if a new sample was stored in sample, 0 if not, and -1 on error, with
+ * errno set, e.g. failing to send.  Polling continues after errors.
+ */
+int sntp_process(struct sntp *s, struct sntp_sample *sample)
+{
+	struct timespec now;
+	uint32_t buf[325];
+	int got = 0;
+
+	while (1) {
+		struct ntptime arrival;
+		struct ntp_reply r;
+		const char *reason;
+		ssize_t num;
+
+		num = recv(s->sd, buf, sizeof(buf), 0);
+		if (num == -1) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK || errno == ECONNREFUSED)
+				break;
+			return -1;
+		}
+		if (num < 48 || !s->pending)
+			continue;
+
+		get_packet_timestamp(s->sd, &arrival);
+		ntp_decode(buf, &arrival, &r);
+		reason = ntp_check(&r, &s->sent);
+		if (reason) {
+			DBG("Rejected reply: %s", reason);
+			continue;
+		}
+
+		s->pending = 0;
+		sntp_sample(s, &r, &arrival, sample);
+		got = 1;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	if (now.tv_sec > s->next.tv_sec || (now.tv_sec == s->next.tv_sec && now.tv_nsec >= s->next.tv_nsec)) {
+		uint32_t data[12];
+
+		s->next.tv_sec = now.tv_sec + s->poll;
+		s->next.tv_nsec = now.tv_nsec;
+
+		ntp_request(data, &s->sent);
+		if (send(s->sd, data, sizeof(data), 0) == -1)
+			return -1;
+		s->pending = 1;
+	}
+
+	return got;
+}
+
+/**
+ * Local Variables:
+ *  indent-tabs-mode: t
+ *  c-file-style: "linux"
+ * End:
+ */
@@ -0,0 +1,75 @@
+/* libsntp, embeddable SNTP client with a non-blocking API
+ *
+ * Copyright (C) 2010-2022  Joachim Wiberg <troglobit@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License (Version 2,
+ * June 1991) as published by the Free Software Foundation.  At the
+ * time of writing, that license was published by the FSF with the URL
+ * http://www.gnu.org/copyleft/gpl.html, and is incorporated herein by
+ * reference.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+/*
+ * The sntpd client, packet checks, clock filter and phase lock, for use
+ * in any event loop.  The library never blocks, has no threads and uses
+ * no signals.  Resolve the server yourself, then:
+ *
+ *     struct sntp *s = sntp_open(ai->ai_addr, ai->ai_addrlen, 64);
+ *     struct sntp_sample ss;
+ *
+ *     while (1) {
+ *             struct pollfd pfd = { .fd = sntp_fd(s), .events = POLLIN };
+ *
+ *             poll(&pfd, 1, sntp_timeout(s));
+ *             if (sntp_process(s, &ss) > 0)
+ *                     printf("offset %.6f sec\n", ss.offset);
+ *     }
+ *
+ * Link with -lsntp -lm -lpthread.
+ */
+
+#ifndef SNTP_H_
+#define SNTP_H_
+
+#include <sys/socket.h>
+#include <time.h>
+
+struct sntp;
+
+struct sntp_sample {
+	struct timespec time;		/* system clock at arrival */
+	double offset;			/* sec, server - system clock */
+	double delay;			/* sec, round-trip */
+	double root_delay;		/* sec, server to its reference */
+	double root_dispersion;		/* sec */
+	int    stratum;			/* of the server */
+	int    leap;			/* 0: none, 1: +1 s, 2: -1 s */
+
+	double filtered;		/* sec, offset of least delay of last eight */
+	double jitter;			/* sec, RMS of filtered offset differences */
+	double freq;			/* ppm, correction from the phase lock */
+};
+
+struct sntp *sntp_open   (const struct sockaddr *sa, socklen_t len, int poll);
+void         sntp_close  (struct sntp *s);
+
+int          sntp_fd     (const struct sntp *s);
+int          sntp_timeout(const struct sntp *s);
+int          sntp_process(struct sntp *s, struct sntp_sample *sample);
+void         sntp_freq   (struct sntp *s, double ppm);
+int          sntp_window (struct sntp *s, int window);
+
+#endif /* SNTP_H_ */
+
+/**
+ * Local Variables:
+ *  indent-tabs-mode: t
+ *  c-file-style: "linux"
+ * End:
+ */
@@ -28,13 +28,13 @@
 #include "config.h"
 #include <err.h>
 #include <getopt.h>
+#include <math.h>		/* fabs() */
 #include <resolv.h>
 #include <signal.h>
 #include <netdb.h>		/* getaddrinfo -> gethostbyname */
+#include <pthread.h>
+#include <sched.h>
 #include <time.h>
-#ifdef PRECISION_SIOCGSTAMP
-#include <sys/ioctl.h>
-#endif
 
 #include "sntpd.h"
 
@@ -43,7 +43,6 @@ int initial_freq = 0;		/* initial freq value to use */
 int daemonize = 0;
 int logging = 1;
 
-const char *prognm = PACKAGE_NAME;
 static volatile sig_atomic_t sighup  = 0;
 static volatile sig_atomic_t sigterm = 0;
 
@@ -51,119 +50,58 @@ struct ntp_peers peer;
 double root_delay;
 double root_dispersion;
 
-/* prototypes for some local routines */
-static int rfc1305print(uint32_t *data, struct ntptime *arrival, struct ntp_control *ntpc, int *error);
-
-/* OS dependent routine to get the current value of clock frequency */
-static int get_current_freq(void)
-{
-#ifdef __linux__
-	struct timex txc;
+static unsigned int refclock_last;	/* NTP sec, last refclock sample used */
 
-	txc.modes = 0;
-	if (adjtimex(&txc) < 0) {
-		ERR(errno, "Failed adjtimex(GET)");
-		exit(1);
-	}
-	return txc.freq;
-#else
-	return 0;
-#endif
-}
-
-/* OS dependent routine to set a new value of clock frequency */
-static int set_freq(int new_freq)
+/*
+ * Holdover, called each poll.  When the server has not replied for
+ * HOLDOVER polls, steer by the frequency predicted from the phase lock
+ * history, which follows ageing and the daily temperature cycle.
+ */
+void holdover(struct ntp_control *ntpc, unsigned int now)
 {
-#ifdef __linux__
-	struct timex txc;
-
-	txc.modes = ADJ_FREQUENCY;
-	txc.freq = new_freq;
-	if (adjtimex(&txc) < 0) {
-		ERR(errno, "Failed adjtimex(SET)");
-		exit(1);
-	}
-	return txc.freq;
-#else
-	return 0;
-#endif
-}
+	int freq;
 
-static void set_time(struct ntptime *new)
-{
-	struct timespec tv_set;
-
-	/* it would be even better to subtract half the slop */
-	tv_set.tv_sec = new->coarse - JAN_1970;
-	/* divide xmttime.fine by 4294.967296 */
-	tv_set.tv_nsec = USEC(new->fine) * 1000;
-	if (clock_settime(CLOCK_REALTIME, &tv_set) < 0) {
-		ERR(errno, "Failed clock_settime()");
-		exit(1);
+	if (!ntpc->live || ntpc->kernel_pll || !peer.pl || !peer.last_reply)
+		return;
+	if (now - peer.last_reply < (unsigned int)(HOLDOVER * ntpc->cycle_time))
+		return;
+	if (phaselock_predict(peer.pl, now, &freq))
+		return;
+
+	if (!peer.holdover) {
+		LOG("No reply from server in %u sec, holdover at %.3f ppm",
+		    now - peer.last_reply, freq / 65536.0);
+		peer.holdover = 1;
+		timepage_update(NULL, 0, ntpc->cycle_time);
 	}
-
-	DBG("Set time to %lu.%.9lu", tv_set.tv_sec, tv_set.tv_nsec);
+	metrics_holdover(freq);
+	if (!dry && freq != get_current_freq())
+		set_freq(freq);
 }
 
-void ntpc_gettime(struct ntptime *nt)
+/* The refclock is selected as long as it delivers, within two polls */
+static int refclock_selected(struct ntp_control *ntpc, unsigned int now)
 {
-	struct timespec now;
+	if (!ntpc->refclock || !refclock_last)
+		return 0;
 
-	clock_gettime(CLOCK_REALTIME, &now);
-	nt->coarse = now.tv_sec + JAN_1970;
-	nt->fine   = NTPFRAC(now.tv_nsec / 1000);
+	return now - refclock_last < (unsigned int)(2 * ntpc->cycle_time);
 }
 
 static int send_packet(int usd, struct ntptime *time_sent)
 {
 	uint32_t data[12];
 
-#define LI 0
-#define VN 3
-#define MODE 3
-#define STRATUM 0
-#define POLL 4
-#define PREC -6
-
 #ifdef ENABLE_DEBUG
 	if (debug)
 		DBG("Sending packet ...");
 #endif
-	if (sizeof(data) != 48) {
-		ERR(0, "Packet size error");
-		return -1;
-	}
-
-	memset(data, 0, sizeof data);
-	data[0] = htonl((LI << 30) | (VN << 27) | (MODE << 24) | (STRATUM << 16) | (POLL << 8) | (PREC & 0xff));
-	data[1] = htonl(1 << 16);	/* Root Delay (seconds) */
-	data[2] = htonl(1 << 16);	/* Root Dispersion (seconds) */
-	ntpc_gettime(time_sent);
-
-	data[10] = htonl(time_sent->coarse);	/* Transmit Timestamp coarse */
-	data[11] = htonl(time_sent->fine);	/* Transmit Timestamp fine   */
+	ntp_request(data, time_sent);
 
+	PROBE(client_send, time_sent->coarse, time_sent->fine);
 	return send(usd, data, 48, 0);
 }
 
-void get_packet_timestamp(int usd, struct ntptime *udp_arrival_ntp)
-{
-#ifdef PRECISION_SIOCGSTAMP
-	struct timeval udp_arrival;
-
-	if (ioctl(usd, SIOCGSTAMP, &udp_arrival) < 0) {
-		ERR(errno, "Failed ioctl(SIOCGSTAMP)");
-		ntpc_gettime(udp_arrival_ntp);
-	} else {
-		udp_arrival_ntp->coarse = udp_arrival.tv_sec + JAN_1970;
-		udp_arrival_ntp->fine = NTPFRAC(udp_arrival.tv_usec);
-	}
-#else
-	(void)usd;		/* not used */
-	ntpc_gettime(udp_arrival_ntp);
-#endif
-}
-
 static int check_source(int data_len, struct sockaddr_storage *ss, struct ntp_control *ntpc)
 {
 	struct sockaddr_in6 *ipv6;
@@ -202,21 +140,82 @@ static int check_source(int data_len, struct sockaddr_storage *ss, struct ntp_co
 	return 0;
 }
 
-static double ntpdiff(struct ntptime *start, struct ntptime *stop)
+/*
+ * Feed an accepted sample, from the server or a refclock, to the clock
+ * discipline, and publish the new reference state to our server and the
+ * metrics.  Offset, delay and errorbar in usec.  The ref holds the root
+ * delay and dispersion of the source, in sec, and is updated with ours.
+ */
+static void discipline(struct ntp_control *ntpc, struct ntptime *arrival, double offset,
+		       double delay, double errorbar, struct ntp_ref *ref)
 {
-	int a;
-	unsigned int b;
+	double dtemp;
 
-	a = stop->coarse - start->coarse;
-	if (stop->fine >= start->fine) {
-		b = stop->fine - start->fine;
-	} else {
-		b = start->fine - stop->fine;
-		b = ~b;
-		a -= 1;
+	/* Update last time set ... */
+	peer.last_update_ts = ref->refclk_ts;
+	peer.last_rootdelay = ref->root_delay;
+	peer.last_rootdisp  = ref->root_dispersion;
+
+	/* delay = (T4 - T1) - (T3 - T2) */
+	peer.last_delay = delay / 1e6;
+	if (peer.last_delay < G_precision_sec)
+                peer.last_delay = G_precision_sec;
+
+	root_delay = peer.last_rootdelay + peer.last_delay;
+	dtemp = G_precision_sec + MIN_DISP; /* XXX: Fixme, see BusyBox ntpd.c */
+	root_dispersion = peer.last_rootdisp + dtemp;
+//	LOG("Calculated root_delay %f, root_dispersion %f", root_delay, root_dispersion);
+
+	ref->root_delay      = root_delay;
+	ref->root_dispersion = root_dispersion;
+	server_update(ref);
+
+	/*
+	 * Not the ideal order for printing, but we want to be sure
+	 * to do all the time-sensitive thinking (and time setting)
+	 * before we start the output, especially fflush() (which
+	 * could be slow).  Of course, if debug is turned on, speed
+	 * has gone down the drain anyway.
+	 */
+	if (ntpc->live && ntpc->kernel_pll) {
+		double maxerror, esterror;
+		int poll_exp = 0;
+
+		while ((1 << poll_exp) < ntpc->cycle_time)
+			poll_exp++;
+
+		if (filter_add(&peer.filter, arrival->coarse, offset, delay) && !dry) {
+			/* error estimates for the kernel, in microseconds */
+			maxerror = (root_delay / 2 + root_dispersion) * 1e6;
+			esterror = peer.filter.jitter;
+			if (esterror < G_precision_sec * 1e6)
+				esterror = G_precision_sec * 1e6;
+
+			/* Stepped, the filtered offsets are from before */
+			if (set_offset(peer.filter.offset, maxerror, esterror, poll_exp) == 1)
+				filter_reset(&peer.filter);
+		}
+	} else if (ntpc->live) {
+		int freq = get_current_freq();
+		int new_freq;
+
+		new_freq = phaselock_feed(peer.pl, arrival->coarse, offset, errorbar, freq);
+
+		/* the phase lock leaves the offset, it adds to the error */
+		if (!dry)
+			set_sync(new_freq, (root_delay / 2 + root_dispersion) * 1e6 + fabs(offset),
+				 MAX(fabs(offset), G_precision_sec * 1e6));
+
+		if (peer.holdover) {
+			LOG("Server back after %u sec, leaving holdover", arrival->coarse - peer.last_reply);
+			peer.holdover = 0;
+		}
+		peer.last_reply = arrival->coarse;
 	}
+	metrics_sample(arrival->coarse, offset, delay, get_current_freq(), root_delay, root_dispersion);
 
-	return a * 1.e6 + b * (1.e6 / 4294967296.0);
+	/* The kernel slews out the offset, the phase lock only steers the frequency */
+	timepage_update(ref, ntpc->live && ntpc->kernel_pll && !dry ? 0 : offset / 1e6, ntpc->cycle_time);
 }
 
 /* Does more than print, so this name is bogus.
@@ -225,149 +224,76 @@ static double ntpdiff(struct ntptime *start, struct ntptime *stop)
  * sets *error to the number of microseconds uncertainty in answer
  * returns 0 normally, 1 if the message fails sanity checks
  */
-static int rfc1305print(uint32_t *data, struct ntptime *arrival, struct ntp_control *ntpc, int *error)
+int rfc1305print(uint32_t *data, struct ntptime *arrival, struct ntp_control *ntpc, int *error)
 {
 	static int first = 1;
-
-	/* straight out of RFC-1305 Appendix A */
-	int li, vn, mode, stratum, prec;
-	int delay, disp;
-
-#ifdef ENABLE_DEBUG
-	int poll, refid;
-	struct ntptime reftime;
-#endif
-	struct ntptimes pkt_root_delay, pkt_root_dispersion;
-	struct ntptime orgtime, rectime, xmttime;
-	double el_time, st_time, skew1, skew2, dtemp;
-	int freq;
 	const char *drop_reason = NULL;
+	struct ntp_reply r;
+	struct ntp_ref ref;
+	int freq;
 
-#define Data(i) ntohl(((uint32_t *)data)[i])
-	li      = Data(0) >> 30 & 0x03;
-	vn      = Data(0) >> 27 & 0x07;
-	mode    = Data(0) >> 24 & 0x07;
-	stratum = Data(0) >> 16 & 0xff;
-#ifdef ENABLE_DEBUG
-	poll    = Data(0) >>  8 & 0xff;
-#endif
-	prec    = Data(0) & 0xff;
-	if (prec & 0x80)
-		prec |= 0xffffff00;
-	delay   = Data(1);
-	disp    = Data(2);
-
-#ifdef ENABLE_DEBUG
-	refid          = Data(3);
-	reftime.coarse = Data(4);
-	reftime.fine   = Data(5);
-#endif
-
-	orgtime.coarse = Data(6);
-	orgtime.fine   = Data(7);
-	rectime.coarse = Data(8);
-	rectime.fine   = Data(9);
-	xmttime.coarse = Data(10);
-	xmttime.fine   = Data(11);
-#undef Data
+	ntp_decode(data, arrival, &r);
 
 #ifdef ENABLE_DEBUG
 	if (debug) {
-		DBG("LI=%d  VN=%d  Mode=%d  Stratum=%d  Poll=%d  Precision=%d", li, vn, mode, stratum, poll, prec);
-		DBG("Delay=%.1f  Dispersion=%.1f  Refid=%u.%u.%u.%u", sec2u(delay), sec2u(disp),
-		      refid >> 24 & 0xff, refid >> 16 & 0xff, refid >> 8 & 0xff, refid & 0xff);
-		DBG("Reference %u.%.6u", reftime.coarse, USEC(reftime.fine));
+		DBG("LI=%d  VN=%d  Mode=%d  Stratum=%d  Poll=%d  Precision=%d", r.li, r.vn, r.mode, r.stratum, r.poll, r.prec);
+		DBG("Delay=%.1f  Dispersion=%.1f  Refid=%u.%u.%u.%u", sec2u(r.delay), sec2u(r.disp),
+		      r.refid >> 24 & 0xff, r.refid >> 16 & 0xff, r.refid >> 8 & 0xff, r.refid & 0xff);
+		DBG("Reference %u.%.6u", r.reftime.coarse, USEC(r.reftime.fine));
 		DBG("(sent)    %u.%.6u", ntpc->time_of_send.coarse, USEC(ntpc->time_of_send.fine));
-		DBG("Originate %u.%.6u", orgtime.coarse, USEC(orgtime.fine));   /* T1 */
-		DBG("Receive   %u.%.6u", rectime.coarse, USEC(rectime.fine));   /* T2 */
-		DBG("Transmit  %u.%.6u", xmttime.coarse, USEC(xmttime.fine));   /* T3 */
+		DBG("Originate %u.%.6u", r.orgtime.coarse, USEC(r.orgtime.fine));   /* T1 */
+		DBG("Receive   %u.%.6u", r.rectime.coarse, USEC(r.rectime.fine));   /* T2 */
+		DBG("Transmit  %u.%.6u", r.xmttime.coarse, USEC(r.xmttime.fine));   /* T3 */
 		DBG("Our recv  %u.%.6u", arrival->coarse, USEC(arrival->fine)); /* T4 */
 	}
 #endif
 
-	el_time = ntpdiff(&orgtime, arrival);	/* elapsed: (T4 - T1)*/
-	st_time = ntpdiff(&rectime, &xmttime);	/* stall: (T3 - T2) */
-	skew1 = ntpdiff(&orgtime, &rectime);
-	skew2 = ntpdiff(&xmttime, arrival);
 	freq = get_current_freq();
 
 #ifdef ENABLE_DEBUG
 	if (debug) {
-		DBG("Total elapsed: %9.2f", el_time);
-		DBG("Server stall:  %9.2f", st_time);
-		DBG("Slop:          %9.2f", el_time - st_time);
-		DBG("Skew:          %9.2f", (skew1 - skew2) / 2);
+		DBG("Total elapsed: %9.2f", r.el_time);
+		DBG("Server stall:  %9.2f", r.st_time);
+		DBG("Slop:          %9.2f", r.el_time - r.st_time);
+		DBG("Skew:          %9.2f", r.offset);
 		DBG("Frequency:     %9d", freq);
 	}
 #endif
 
-	/* error checking, see RFC-4330 section 5 */
-#define FAIL(x) do { drop_reason=(x); goto fail;} while (0)
 	if (ntpc->cross_check) {
-		if (li == 3)
-			FAIL("LI==3");	/* unsynchronized */
-		if (vn < 3)
-			FAIL("VN<3");	/* RFC-4330 documents SNTP v4, but we interoperate with NTP v3 */
-		if (mode != 4)
-			FAIL("MODE!=3");
-		if (orgtime.coarse != ntpc->time_of_send.coarse || orgtime.fine != ntpc->time_of_send.fine)
-			FAIL("ORG!=sent");
-		if (xmttime.coarse == 0 && xmttime.fine == 0)
-			FAIL("XMT==0");
-		if (delay > 65536 || delay < -65536)
-			FAIL("abs(DELAY)>65536");
-		if (disp > 65536 || disp < -65536)
-			FAIL("abs(DISP)>65536");
-		if (stratum == 0)
-			FAIL("STRATUM==0");	/* kiss o' death */
-#undef FAIL
+		drop_reason = ntp_check(&r, &ntpc->time_of_send);
+		if (drop_reason)
+			goto fail;
 	}
 
+	PROBE(sample_accept, arrival->coarse, arrival->fine, (long long)(r.offset * 1000),
+	      (long long)((r.el_time - r.st_time) * 1000), freq);
+
 	if (!dry && ntpc->set_clock) {
-		/* CAP_SYS_TIME or root required, or sntpd will exit here! */
-		set_time(&xmttime);
-		LOG("Time synchronized to server %s, stratum %d", ntpc->server, stratum);
+		/* CAP_SYS_TIME or root required, ntpclient -s exits here! */
+		if (set_time(r.offset, ntpc->step_threshold)) {
+			if (ntpc->usermode)
+				exit(1);
+		} else {
+			LOG("Time synchronized to server %s, stratum %d", ntpc->server, r.stratum);
+		}
 	}
 
-	/* Update last time set ... */
-	pkt_root_delay.coarse = ((uint32_t)delay >> 16) & 0xFFFF;
-	pkt_root_delay.fine   = ((uint32_t)delay >>  0) & 0xFFFF;
-	pkt_root_dispersion.coarse = ((uint32_t)disp >> 16) & 0xFFFF;
-	pkt_root_dispersion.fine   = ((uint32_t)disp >>  0) & 0xFFFF;
-
-	peer.last_update_ts = xmttime;
-	peer.last_rootdelay = wire2d32(&pkt_root_delay);
-	peer.last_rootdisp  = wire2d32(&pkt_root_dispersion);
-
-	/* delay = (T4 - T1) - (T3 - T2) */
-	peer.last_delay = (wire2d64(arrival) - wire2d64(&orgtime)) - (wire2d64(&xmttime) - wire2d64(&rectime));
-	if (peer.last_delay < G_precision_sec)
-                peer.last_delay = G_precision_sec;
-
-	root_delay = peer.last_rootdelay + peer.last_delay;
-	dtemp = G_precision_sec + MIN_DISP; /* XXX: Fixme, see BusyBox ntpd.c */
-	root_dispersion = peer.last_rootdisp + dtemp;
-//	LOG("Calculated root_delay %f, root_dispersion %f", root_delay, root_dispersion);
-
-	/*
-	 * Not the ideal order for printing, but we want to be sure
-	 * to do all the time-sensitive thinking (and time setting)
-	 * before we start the output, especially fflush() (which
-	 * could be slow).  Of course, if debug is turned on, speed
-	 * has gone down the drain anyway.
-	 */
-	if (ntpc->live) {
-		int new_freq;
-
-		new_freq = contemplate_data(arrival->coarse,
-					    (skew1 - skew2) / 2,
-					    el_time + sec2u(disp),
-					    freq);
-
-		if (!dry && new_freq != freq)
-			set_freq(new_freq);
+	if (refclock_selected(ntpc, arrival->coarse)) {
+		DBG("Reply from %s not used, refclock selected", ntpc->server);
+		*error = r.el_time - r.st_time;
+		return 0;
 	}
 
+	memset(&ref, 0, sizeof(ref));
+	ref.refclk_ts       = r.xmttime;
+	ref.root_delay      = r.root_delay;
+	ref.root_dispersion = r.root_dispersion;
+	ref.stratum         = MIN(r.stratum + 1, 15);
+	ref.leap            = r.li;
+	discipline(ntpc, arrival, r.offset, r.el_time - r.st_time,
+		   r.el_time + sec2u(r.disp), &ref);
+
 	/*
 	 * Display by default for ntpclient users, sntpd must run with -l info:
 	 * Day   Second      Elapsed    Stall      Skew  Dispersion  Freq
@@ -379,13 +305,14 @@ static int rfc1305print(uint32_t *data, struct ntptime *arrival, struct ntp_cont
 	}
 	INFO("%d %.5d.%.3d  %8.1f %8.1f  %8.1f %8.1f %9d",
 	     arrival->coarse / 86400, arrival->coarse % 86400,
-	     arrival->fine / 4294967, el_time, st_time,
-	     (skew1 - skew2) / 2, sec2u(disp), freq);
+	     arrival->fine / 4294967, r.el_time, r.st_time,
+	     r.offset, sec2u(r.disp), freq);
 
-	*error = el_time - st_time;
+	*error = r.el_time - r.st_time;
 
 	return 0;
  fail:
+	PROBE(sample_reject, arrival->coarse, arrival->fine, drop_reason);
 	ERR(0, "%d %.5d.%.3d rejected packet: %s",
 	    arrival->coarse / 86400, arrival->coarse % 86400,
 	    arrival->fine / 4294967, drop_reason);
@@ -393,6 +320,51 @@ static int rfc1305print(uint32_t *data, struct ntptime *arrival, struct ntp_cont
 	return 1;
 }
 
+/*
+ * Called each poll, feed the median of the refclock samples since the
+ * last poll to the discipline.  Our server is then stratum 1.  Without
+ * samples for two polls the network server takes over again.
+ */
+static void refclock_feed(struct ntp_control *ntpc, unsigned int now)
+{
+	struct refclock_sample rs;
+	struct ntp_ref ref;
+	double disp;
+
+	if (!ntpc->refclock)
+		return;
+
+	if (refclock_poll(&rs)) {
+		if (refclock_last && !refclock_selected(ntpc, now)) {
+			LOG("No samples from refclock %s, back to server %s", ntpc->refclock, ntpc->server);
+			refclock_last = 0;
+			filter_reset(&peer.filter);
+			metrics_server(ntpc->server);
+		}
+		return;
+	}
+
+	if (!refclock_selected(ntpc, now)) {
+		LOG("Selecting refclock %s, stratum 1", ntpc->refclock);
+		filter_reset(&peer.filter);
+		metrics_server(ntpc->refclock);
+	}
+	refclock_last = now;
+
+	/* Errorbar as phaselock.c expects, min_delay is subtracted */
+	disp = MAX(rs.disp, G_precision_sec * 1e6);
+
+	memset(&ref, 0, sizeof(ref));
+	ref.refclk_ts       = rs.arrival;
+	ref.root_dispersion = disp / 1e6;
+	ref.stratum         = 1;
+	memcpy(ref.refid, rs.refid, sizeof(ref.refid));
+	discipline(ntpc, &rs.arrival, rs.offset, 0, phaselock_defaults.min_delay + 2 * disp, &ref);
+
+	INFO("Refclock %s offset %.1f usec, dispersion %.1f usec, %u samples",
+	     ntpc->refclock, rs.offset, rs.disp, rs.num);
+}
+
 int setup_receive(int usd, sa_family_t sin_family, uint16_t port)
 {
 	struct sockaddr_in6 sin6;
@@ -606,23 +578,114 @@ static void setup_signals(void)
 	sigaction(SIGALRM, &sa, NULL);
 }
 
+static time_t uptime(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec;
+}
+
+/* Work due every poll that needs no server, also when it is unreachable */
+static void local_poll(struct ntp_control *ntpc)
+{
+	struct ntptime now;
+
+	ntpc_gettime(&now);
+	refclock_feed(ntpc, now.coarse);
+	holdover(ntpc, now.coarse);
+	log_summary();
+}
+
+/*
+ * Network or name resolution is down.  Wait for rtnetlink to report a
+ * new address, route or running interface, for a control command or a
+ * signal, but at most backoff seconds, which doubles on every call up
+ * to RETRY_MAX, for when only DNS is down.  Meanwhile a refclock is
+ * still fed every poll, at *tick, a GPS site may have no network at all,
+ * and without one the clock enters holdover when the server is gone.
+ */
+static void netdown_wait(struct ntp_control *ntpc, int nld, int *backoff, time_t *tick)
+{
+	time_t now, retry;
+
+	*backoff = *backoff ? MIN(*backoff * 2, RETRY_MAX) : 1;
+	retry = uptime() + *backoff;
+
+	while (!sigterm && !sighup) {
+		struct timeval to;
+		fd_set fds;
+		int max, rc;
+
+		now = uptime();
+		if (now >= *tick) {
+			local_poll(ntpc);
+			*tick = now + ntpc->cycle_time;
+		}
+		if (now >= retry)
+			break;
+
+		to.tv_sec  = MIN(retry, *tick) - now;
+		to.tv_usec = 0;
+
+		FD_ZERO(&fds);
+		if (nld != -1)
+			FD_SET(nld, &fds);
+		max = control_fds(&fds, nld);
+
+		rc = select(max + 1, &fds, NULL, NULL, &to);
+		if (rc < 0 && errno != EINTR) {
+			ERR(errno, "Failed select()");
+			break;
+		}
+		if (rc <= 0)
+			continue;
+
+		if (nld != -1 && FD_ISSET(nld, &fds) && netlink_event(nld)) {
+			DBG("Network change, retrying now.");
+			*backoff = 0;
+			break;
+		}
+		if (control_handle(&fds, ntpc) & (CONTROL_RESYNC | CONTROL_POLL)) {
+			*backoff = 0;
+			break;
+		}
+	}
+}
+
 static void loop(struct ntp_control *ntpc)
 {
 	fd_set fds;
 	struct sockaddr_storage sa_xmit;
-	int i, pack_len, probes_sent, error;
+	int i, max, act, pack_len, probes_sent, error;
 	socklen_t sa_xmit_len;
 	struct timeval to;
 	struct ntptime udp_arrival_ntp;
 	static uint32_t incoming_word[325];
+	time_t last_save = time(NULL);
+	time_t tick = 0;		/* uptime of next poll */
+	int backoff = 0;
+	int nld = -1;
 	int usd = -1;
-	int sd = -1;
 
 #define incoming ((char *) incoming_word)
 #define sizeof_incoming (sizeof incoming_word)
 
-	if (ntpc->server_port)
-		sd = server_init(ntpc->server_port);
+	if (ntpc->capture_file)
+		capture_open(ntpc->capture_file);
+
+	if (ntpc->server_port && server_init(ntpc->server_port))
+		ERR(0, "Failed starting server on port %u, continuing as client only", ntpc->server_port);
+
+	/* After server thread is started, it should not inherit this */
+	if (ntpc->priority > 0) {
+		struct sched_param sp = { .sched_priority = ntpc->priority };
+		int rc;
+
+		rc = pthread_setschedparam(pthread_self(), SCHED_FIFO, &sp);
+		if (rc)
+			ERR(rc, "Failed setting client priority %d", ntpc->priority);
+	}
 
 #ifdef ENABLE_DEBUG
 	if (debug)
@@ -639,7 +702,7 @@ static void loop(struct ntp_control *ntpc)
 			break;
 		}
 		if (sighup || usd == -1) {
-			int init;
+			int init = 0;
 
 			sighup = 0;
 			to.tv_sec = 0;
@@ -650,11 +713,15 @@ static void loop(struct ntp_control *ntpc)
 			else
 				close(usd);
 
+			/* Subscribe before trying, not to miss the network coming up */
+			if (nld == -1)
+				nld = netlink_open();
+
 			usd = setup_socket(ntpc);
 			if (usd == -1) {
-				/* Wait here a while, networking is probably not up yet. */
+				/* Networking is probably not up yet, wait for it */
 				if (errno == ENETDOWN) {
-					sleep(1);
+					netdown_wait(ntpc, nld, &backoff, &tick);
 					continue;
 				}
 				ERR(errno, init ? "Failed creating UDP socket()"
@@ -662,17 +729,23 @@ static void loop(struct ntp_control *ntpc)
 				goto done;
 			}
 
-			if (!init)
+			netlink_close(nld);
+			nld = -1;
+			backoff = 0;
+
+			if (!init) {
 				DBG("Got SIGHUP, triggering resync with NTP server.");
+				if (ntpc->capture_file)
+					capture_open(ntpc->capture_file);
+			}
 			init = 0;
 		}
 
 		FD_ZERO(&fds);
 		FD_SET(usd, &fds);
-		if (sd > -1)
-			FD_SET(sd, &fds);
+		max = control_fds(&fds, usd);
 
-		i = select(usd + 1, &fds, NULL, NULL, &to);	/* Wait on read or error */
+		i = select(max + 1, &fds, NULL, NULL, &to);	/* Wait on read or error */
 		if (i <= 0) {
 			if (i < 0) {
 				if (errno != EINTR)
@@ -684,23 +757,36 @@ static void loop(struct ntp_control *ntpc)
 				if (probes_sent >= ntpc->probe_count && ntpc->probe_count != 0)
 					break;
 
+				local_poll(ntpc);
+
 				if (send_packet(usd, &ntpc->time_of_send) == -1) {
 					ERR(errno, "Failed sending probe");
 					to.tv_sec = MIN_INTERVAL;
 					to.tv_usec = 0;
 				} else {
 					++probes_sent;
+					metrics_poll(ntpc->cycle_time);
 					to.tv_sec = ntpc->cycle_time;
 					to.tv_usec = 0;
+					if (ntpc->burst > 0) {
+						ntpc->burst--;
+						to.tv_sec = MIN_INTERVAL;
+					}
 				}
+				tick = uptime() + to.tv_sec;
 			}
 			continue;
 		}
 
-		if (sd > -1 && FD_ISSET(sd, &fds)) {
-			server_recv(sd);
-			continue;
+		act = control_handle(&fds, ntpc);
+		if (act & CONTROL_RESYNC)
+			sighup = 1;
+		if (act & CONTROL_POLL) {
+			to.tv_sec = 0;
+			to.tv_usec = 0;
 		}
+		if (!FD_ISSET(usd, &fds))
+			continue;
 
 		error = ntpc->goodness;
 		pack_len = recvfrom(usd, incoming, sizeof_incoming, 0, (struct sockaddr *)&sa_xmit, &sa_xmit_len);
@@ -710,8 +796,17 @@ static void loop(struct ntp_control *ntpc)
 			get_packet_timestamp(usd, &udp_arrival_ntp);
 			if (check_source(pack_len, &sa_xmit, ntpc))
 				continue;
+			if (ntpc->capture_file && pack_len >= 48)
+				capture_write(incoming_word, &ntpc->time_of_send, &udp_arrival_ntp,
+					      get_current_freq());
 			if (rfc1305print(incoming_word, &udp_arrival_ntp, ntpc, &error) != 0)
 				continue;
+
+			if (ntpc->state_file && ntpc->live && !dry &&
+			    time(NULL) - last_save >= STATE_INTERVAL) {
+				state_save(ntpc->state_file, get_current_freq());
+				last_save = time(NULL);
+			}
 		} else {
 			ERR(0, "Ooops.  pack_len=%d", pack_len);
 		}
@@ -733,50 +828,10 @@ static void loop(struct ntp_control *ntpc)
 done:
 	if (usd != -1)
 		close(usd);
-	if (sd != -1)
-		close(sd);
-}
-
-#ifdef ENABLE_REPLAY
-static int do_replay(void)
-{
-	char line[100];
-	int n, day, freq, absolute;
-	float sec, el_time, st_time, disp;
-	double skew, errorbar;
-	int simulated_freq = 0;
-	unsigned int last_fake_time = 0;
-	double fake_delta_time = 0.0;
-
-	while (fgets(line, sizeof line, stdin)) {
-		n = sscanf(line, "%d %f %f %f %lf %f %d", &day, &sec, &el_time, &st_time, &skew, &disp, &freq);
-		if (n == 7) {
-			DBG("%s", line);
-
-			absolute = day * 86400 + (int)sec;
-			errorbar = el_time + disp;
-#ifdef ENABLE_DEBUG
-			DBG("Contemplate %u %.1f %.1f %d", absolute, skew, errorbar, freq);
-#endif
-			if (last_fake_time == 0)
-				simulated_freq = freq;
-			fake_delta_time += (absolute - last_fake_time) * ((double)(freq - simulated_freq)) / 65536;
-#ifdef ENABLE_DEBUG
-			DBG("Fake %f %d", fake_delta_time, simulated_freq);
-#endif
-			skew += fake_delta_time;
-			freq = simulated_freq;
-			last_fake_time = absolute;
-			simulated_freq = contemplate_data(absolute, skew, errorbar, freq);
-		} else {
-			ERR(0, "Replay input error");
-			return 2;
-		}
-	}
-
-	return 0;
+	netlink_close(nld);
+	capture_close();
+	server_exit();
 }
-#endif
 
 static void run(struct ntp_control *ntpc, int log_level)
 {
@@ -805,6 +860,25 @@ static void run(struct ntp_control *ntpc, int log_level)
 	if (ntpc->probe_count != 1 && ntpc->cycle_time < MIN_INTERVAL)
 		ntpc->cycle_time = MIN_INTERVAL;
 
+	peer.pl = phaselock_create(phaselock_defaults.window);
+	if (!peer.pl) {
+		ERR(errno, "Failed creating phase lock");
+		exit(1);
+	}
+
+	/* Warm restart, samples older than one ring buffer are useless */
+	if (ntpc->state_file) {
+		int freq;
+
+		if (!state_load(ntpc->state_file, &freq, phaselock_defaults.window * ntpc->cycle_time) && !dry) {
+			DBG("Restored frequency %d", freq);
+			set_freq(freq);
+		}
+	}
+
+	if (ntpc->trace_file && !trace_open(ntpc->trace_file, 1))
+		trace_subscribe(peer.pl);
+
 #ifdef ENABLE_DEBUG
 	DBG("Configuration:");
 	DBG("  probe_count %d", ntpc->probe_count);
@@ -813,9 +887,12 @@ static void run(struct ntp_control *ntpc, int log_level)
 	DBG("  hostname    %s", ntpc->server);
 	DBG("  interval    %d", ntpc->cycle_time);
 	DBG("  live        %d", ntpc->live);
+	DBG("  kernel_pll  %d", ntpc->kernel_pll);
+	DBG("  priority    %d", ntpc->priority);
 	DBG("  local_port  %d", ntpc->local_udp_port);
-	DBG("  min_delay   %f", min_delay);
+	DBG("  min_delay   %f", phaselock_defaults.min_delay);
 	DBG("  set_clock   %d", ntpc->set_clock);
+	DBG("  step_thresh %d", ntpc->step_threshold);
 	DBG("  cross_check %d", ntpc->cross_check);
 #endif
 
@@ -827,6 +904,21 @@ static void run(struct ntp_control *ntpc, int log_level)
 		}
 	}
 
+	/* Keep syslog off the timing path, ntpclient output stays in order */
+	if (!ntpc->usermode) {
+		log_async();
+		log_ratelimit(1);
+	}
+	metrics_server(ntpc->server);
+	if (ntpc->metrics)
+		metrics_init(ntpc->metrics);
+	if (ntpc->control)
+		control_init(ntpc->control);
+	if (ntpc->refclock && refclock_init(ntpc->refclock))
+		ntpc->refclock = NULL;
+	if (ntpc->timepage)
+		timepage_init(ntpc->timepage);
+
 	if (!ntpc->usermode)
 		LOG("Starting " PACKAGE_NAME " v" PACKAGE_VERSION);
 	setup_signals();
@@ -834,6 +926,15 @@ static void run(struct ntp_control *ntpc, int log_level)
 	INFO("Using time sync server: %s", ntpc->server);
 
 	loop(ntpc);
+	timepage_exit();
+	refclock_exit();
+	control_exit();
+	metrics_exit();
+
+	if (ntpc->state_file && !dry)
+		state_save(ntpc->state_file, get_current_freq());
+	trace_close();
+	phaselock_destroy(peer.pl);
 
 	if (!ntpc->usermode)
 		LOG("Stopping " PACKAGE_NAME " v" PACKAGE_VERSION);
@@ -852,6 +953,7 @@ static int ntpclient_usage(int code)
 		"Usage:\n"
 		"  ntpclient [-c count] [-d] [-f frequency] [-g goodness] -h hostname\n"
 		"            [-i interval] [-l] [-p port] [-q min_delay] [-r] [-s] [-t]\n"
+		"            [-x threshold]\n"
 		"\n"
 		"Options:\n"
 		"  -c count      stop after count time measurements (default 0 means go forever)\n"
@@ -865,10 +967,12 @@ static int ntpclient_usage(int code)
 		"  -p port       local NTP client UDP port (default 0 means \"any available\")\n"
 		"  -q min_delay  minimum packet delay for transaction (default 800 microseconds)\n"
 #ifdef ENABLE_REPLAY
-		"  -r            replay analysis code based on stdin\n"
+		"  -r            replay analysis of log files given as arguments, or stdin\n"
 #endif
 		"  -s            simple clock set (implies -c 1)\n"
 		"  -t            trust network and server, no RFC-4330 recommended cross-checks\n"
+		"  -x threshold  with -s, slew offsets smaller than threshold (microseconds)\n"
+		"                instead of stepping (default 0 means always step)\n"
 		"\n"
 #ifdef PACKAGE_BUGREPORT
 		"Bug report address: " PACKAGE_BUGREPORT "\n"
@@ -882,6 +986,9 @@ static int ntpclient_usage(int code)
 static int ntpclient(int argc, char *argv[])
 {
 	struct ntp_control ntpc;
+#ifdef ENABLE_REPLAY
+	int do_replay = 0;
+#endif
 	int c;
 
 	memset(&ntpc, 0, sizeof(ntpc));
@@ -897,7 +1004,7 @@ static int ntpclient(int argc, char *argv[])
 	logging          = 0;
 
 	while (1) {
-		char opts[] = "c:df:g:h:i:lp:q:" REPLAY_OPTION "st?";
+		char opts[] = "c:df:g:h:i:lp:q:" REPLAY_OPTION "stx:?";
 
 		c = getopt(argc, argv, opts);
 		if (c == EOF)
@@ -937,12 +1044,13 @@ static int ntpclient(int argc, char *argv[])
 			break;
 
 		case 'q':
-			min_delay = atof(optarg);
+			phaselock_defaults.min_delay = atof(optarg);
 			break;
 
 #ifdef ENABLE_REPLAY
 		case 'r':
-			return do_replay();
+			do_replay = 1;
+			break;
 #endif
 
 		case 's':
@@ -953,6 +1061,10 @@ static int ntpclient(int argc, char *argv[])
 			ntpc.cross_check = 0;
 			break;
 
+		case 'x':
+			ntpc.step_threshold = atoi(optarg);
+			break;
+
 		case '?':
 			return ntpclient_usage(0);
 
@@ -961,6 +1073,10 @@ static int ntpclient(int argc, char *argv[])
 		}
 	}
 
+#ifdef ENABLE_REPLAY
+	if (do_replay)
+		return replay(argc - optind, argv + optind);
+#endif
 	if (!ntpc.server)
 		return ntpclient_usage(1);
 
@@ -978,23 +1094,46 @@ static int usage(int code)
 
 	fprintf(fp,
 		"Usage:\n"
-		"  %s [-dhn" REPLAY_OPTION "stV] [-i SEC] [-l LEVEL] [-p PORT] [-q USEC] [SERVER]\n"
+		"  %s [-dhkn" REPLAY_OPTION "stV] [-c CMD] [-e PATH] [-f FILE] [-i SEC] [-l LEVEL] [-m ADDR]\n"
+		"        [-o SPEC] [-p PORT] [-P PRIO] [-q USEC] [-R SPEC] [-T SPEC] [-u PATH] [-w FILE] [SERVER]\n"
 		"\n"
 		"Options:\n"
+#ifdef ENABLE_REPLAY
+		"  -A NUM   Tune phase lock, try NUM parameter sets with -S SPEC, or\n"
+		"           on log FILEs given as arguments, report the best\n"
+#endif
+		"  -c CMD   Send CMD to a running sntpd on control socket -u PATH, e.g.\n"
+		"           tracking, sources, stats, burst, server NAME, help\n"
 		"  -d       Dry run, no time correction, useful for debugging\n"
+		"  -e PATH  Publish clock state in a shared memory time page at PATH,\n"
+		"           e.g. /dev/shm/sntpd, see sntpd_timepage.h\n"
+		"  -f FILE  Save drift and phase lock state in FILE, restored at start\n"
 		"  -h       Show summary of command line options and exit\n"
 		"  -i SEC   Check time every interval seconds.  Default: 600\n"
+		"  -k       Use kernel PLL to discipline the clock, not the built-in\n"
+		"           phase lock.  Linux only, requires CAP_SYS_TIME\n"
 		"  -l LEVEL Set log level: none, err, warn, notice (default), info, debug\n"
+		"  -m ADDR  Serve OpenMetrics on [IP:]PORT, default localhost, or PATH\n"
+		"           of a UNIX socket\n"
 		"  -n       Don't fork.  Prevents %s from daemonizing by default\n"
 		"           Use with '-s' to use syslog as well, for Finit + systemd\n"
 		"  -p PORT  SNTP server mode port, default: 123, use 0 to disable\n"
+		"  -o SPEC  Trace phase lock to [csv:|bin:]FILE, - for stdout\n"
+		"  -P PRIO  Run client at real-time priority PRIO, server is unaffected\n"
 		"  -q USEC  Minimum packet delay for transaction, default: 800 usec\n"
+		"  -R SPEC  Local reference clock, e.g. GPS, SPEC is ntpd's shm:N or\n"
+		"           chrony's sock:PATH, the server is used when it is silent\n"
 #ifdef ENABLE_REPLAY
-		"  -r       Replay analysis code based on stdin\n"
+		"  -r       Replay analysis of log or capture FILEs given as arguments,\n"
+		"           or stdin\n"
+		"  -S SPEC  Simulate oscillator and network, SPEC is key=value[,...]\n"
 #endif
 		"  -s       Use syslog instead of stdout, default unless -n\n"
 		"  -t       Trust network and server, disable RFC4330 validation\n"
+		"  -T SPEC  Phase lock tuning, SPEC is name=value[,...], see man page\n"
+		"  -u PATH  Control socket, for -c CMD and e.g. socat\n"
 		"  -v       Show program version\n"
+		"  -w FILE  Write binary capture of all replies to FILE, for replay\n"
 		"\n"
 		"Arguments:\n"
 		"  SERVER   Optional NTP server to sync with, default: pool.ntp.org\n"
@@ -1024,6 +1163,12 @@ int main(int argc, char *argv[])
 {
 	struct ntp_control ntpc;
 	int log_level = LOG_NOTICE;
+	char *control_cmd = NULL;
+#ifdef ENABLE_REPLAY
+	char *sim_spec = NULL;
+	int do_replay = 0;
+	int do_tune = 0;
+#endif
 
 	/* sntpd is a multicall binary, how are we called? */
 	prognm = progname(argv[0]);
@@ -1047,7 +1192,7 @@ int main(int argc, char *argv[])
 	daemonize        = 1;
 
 	while (1) {
-		char opts[] = "dhi:l:np:q:" REPLAY_OPTION "stv?";
+		char opts[] = "c:de:f:hi:kl:m:no:p:P:q:" REPLAY_OPTION "R:" SIM_OPTION "stT:u:vw:?";
 		int c;
 
 		c = getopt(argc, argv, opts);
@@ -1055,10 +1200,28 @@ int main(int argc, char *argv[])
 			break;
 
 		switch (c) {
+#ifdef ENABLE_REPLAY
+		case 'A':
+			do_tune = atoi(optarg);
+			break;
+#endif
+
+		case 'c':
+			control_cmd = optarg;
+			break;
+
 		case 'd':
 			dry = 1;
 			break;
 
+		case 'e':
+			ntpc.timepage = optarg;
+			break;
+
+		case 'f':
+			ntpc.state_file = optarg;
+			break;
+
 		case 'h':
 			return usage(0);
 
@@ -1066,28 +1229,55 @@ int main(int argc, char *argv[])
 			ntpc.cycle_time = atoi(optarg);
 			break;
 
+		case 'k':
+			ntpc.kernel_pll = 1;
+			break;
+
 		case 'l':
 			log_level = log_str2lvl(optarg);
 			if (log_level == -1)
 				return usage(1);
 			break;
 
+		case 'm':
+			ntpc.metrics = optarg;
+			break;
+
 		case 'n':
 			daemonize = 0;
 			logging--;
 			break;
 
+		case 'o':
+			ntpc.trace_file = optarg;
+			break;
+
 		case 'p':
 			ntpc.server_port = atoi(optarg);
 			break;
 
+		case 'P':
+			ntpc.priority = atoi(optarg);
+			break;
+
 		case 'q':
-			min_delay = atof(optarg);
+			phaselock_defaults.min_delay = atof(optarg);
 			break;
 
 #ifdef ENABLE_REPLAY
 		case 'r':
-			return do_replay();
+			do_replay = 1;
+			break;
+#endif
+
+		case 'R':
+			ntpc.refclock = optarg;
+			break;
+
+#ifdef ENABLE_REPLAY
+		case 'S':
+			sim_spec = optarg;
+			break;
 #endif
 
 		case 's':
@@ -1098,16 +1288,58 @@ int main(int argc, char *argv[])
 			ntpc.cross_check = 0;
 			break;
 
+		case 'T':
+			if (phaselock_tune(&phaselock_defaults, optarg))
+				return usage(1);
+			break;
+
+		case 'u':
+			ntpc.control = optarg;
+			break;
+
 		case 'v':
 			puts("v" PACKAGE_VERSION);
 			return 0;
 
+		case 'w':
+			ntpc.capture_file = optarg;
+			break;
+
 		case '?':
 		default:
 			return usage(0);
 		}
 	}
 
+	if (control_cmd) {
+		if (!ntpc.control) {
+			fprintf(stderr, "%s: -c requires the control socket, -u PATH\n", prognm);
+			return 1;
+		}
+		return control_client(ntpc.control, control_cmd);
+	}
+
+#ifdef ENABLE_REPLAY
+	if (do_tune) {
+		log_init(0, log_level);
+		return tune(&ntpc, do_tune, sim_spec, argc - optind, argv + optind);
+	}
+	if (do_replay || sim_spec) {
+		int rc;
+
+		log_init(0, log_level);
+		if (ntpc.trace_file && trace_open(ntpc.trace_file, 0))
+			return 1;
+		if (do_replay)
+			rc = replay(argc - optind, argv + optind);
+		else
+			rc = simulate(&ntpc, sim_spec);
+		trace_close();
+
+		return rc;
+	}
+#endif
+
 	if (optind < argc) {
 		char *arg;
 		char *ptr;
@@ -41,8 +41,10 @@
 
 #ifdef ENABLE_REPLAY
 # define REPLAY_OPTION   "r"
+# define SIM_OPTION      "A:S:"
 #else
 # define REPLAY_OPTION   ""
+# define SIM_OPTION      ""
 #endif
 
 #define ERR(code, fmt, args...)  logit(LOG_ERR,    code, fmt, ##args)
@@ -50,6 +52,19 @@
 #define INFO(fmt, args...)       logit(LOG_INFO,      0, fmt, ##args)
 #define DBG(fmt,  args...)       logit(LOG_DEBUG,     0, fmt, ##args)
 
+/*
+ * USDT probes, provider sntpd, for bpftrace, perf and SystemTap.  Each
+ * is a nop until attached.  Built without --enable-usdt they, and their
+ * arguments, compile away.  Times are NTP seconds and fractions, offsets
+ * and delays nanoseconds, frequencies ppm * 65536.
+ */
+#ifdef ENABLE_USDT
+# include <sys/sdt.h>
+# define PROBE(name, args...)    STAP_PROBEV(sntpd, name, ##args)
+#else
+# define PROBE(name, args...)    do { } while (0)
+#endif
+
 /* XXX fixme - non-automatic build configuration */
 #ifdef __linux__
 #include <sys/utsname.h>
@@ -69,6 +84,26 @@ char __hstrerror_buf[10];
 #define MIN_INTERVAL 15
 #endif
 
+/* Longest wait, seconds, between retries while the network is down */
+#ifndef RETRY_MAX
+#define RETRY_MAX 64
+#endif
+
+/* Phase lock ring buffer, number of samples before any decision */
+#ifndef RING_SIZE
+#define RING_SIZE 16
+#endif
+
+/* How often to save the state file, seconds */
+#ifndef STATE_INTERVAL
+#define STATE_INTERVAL 3600
+#endif
+
+/* Polls without reply before holdover on predicted frequency */
+#ifndef HOLDOVER
+#define HOLDOVER 4
+#endif
+
 #ifndef MIN_DISP
 #define MIN_DISP 0.01
 #endif
@@ -146,15 +181,26 @@ struct ntp_control {
 	int usermode;		/* 0: sntpd, 1: ntpclient */
 	int live;
 	int set_clock;		/* non-zero presumably needs CAP_SYS_TIME or root */
+	int step_threshold;	/* usec, smaller offsets are slewed, 0: always step */
 	int probe_count;
 	int cycle_time;
 	int goodness;
 	int cross_check;
+	int kernel_pll;		/* hand offsets to the kernel PLL, not phaselock.c */
+	int priority;		/* SCHED_FIFO priority of client, 0: disabled */
 
 	uint16_t local_udp_port;
 	uint16_t udp_port;	/* remote port on 'server' */
 	uint16_t server_port;
 	char *server;		/* must be set in client mode */
+	char *state_file;	/* drift and phase lock state, optional */
+	char *capture_file;	/* binary capture of replies, optional */
+	char *trace_file;	/* phase lock trace, [csv:|bin:]FILE, optional */
+	char *metrics;		/* OpenMetrics endpoint, [ADDR:]PORT or PATH */
+	char *control;		/* control socket, PATH */
+	char *refclock;		/* local reference clock, shm:N or sock:PATH */
+	char *timepage;		/* shared memory time page, PATH */
+	int burst;		/* polls left at MIN_INTERVAL, see control.c */
 	char serv_addr[4];
 };
 
@@ -175,38 +221,350 @@ struct ntp {
 	struct ntptime xmit_ts;		/* 40: */
 };
 
+#define FILTER_SIZE 8
+
+struct ntp_filter {
+	struct {
+		unsigned int absolute;
+		double offset;		/* usec */
+		double delay;		/* usec */
+	} sample[FILTER_SIZE];
+	int rp, valid;
+
+	unsigned int last;		/* time of last sample used */
+	double offset;			/* filtered offset, usec */
+	double delay;			/* round-trip delay of that sample, usec */
+	double jitter;			/* RMS of offset differences, usec */
+};
+
 struct ntp_peers {
 	struct ntptime last_update_ts;
+	struct ntp_filter filter;
+	struct phaselock *pl;
 
 	double last_rootdelay;
 	double last_rootdisp;
 	double last_delay;
+
+	unsigned int last_reply;	/* NTP sec, last reply fed phase lock */
+	int    holdover;		/* steering by predicted freq */
+};
+
+/* Phase lock engines, see phaselock.c */
+#define PHASELOCK_POLYGON 0	/* Larry's envelope of consistent lines */
+#define PHASELOCK_KALMAN  1	/* two-state Kalman filter */
+
+/* Phase lock tuning parameters, see phaselock.c for defaults */
+struct phaselock_param {
+	int    engine;		/* PHASELOCK_POLYGON or PHASELOCK_KALMAN */
+	int    window;		/* samples in the ring, for phaselock_create() */
+	double min_delay;	/* usec, subtracted from each errorbar */
+	double max_correct;	/* ppm, largest frequency correction */
+	double min_init;	/* ppm, largest frequency change per sample */
+	double shift_fast;	/* sec, find_shift() time constant */
+	double shift_slow;	/* sec, find_shift() time constant, slow line */
+	double shift_bias;	/* ppm, find_shift() slope bias, slow line */
+	double crit_time;	/* usec, find_df_center() offset range */
+	double center_fast;	/* sec, find_df_center() time constant */
+	double center_slow;	/* sec, find_df_center() time constant */
+	double kalman_tau;	/* sec, phase correction time constant, kalman */
+};
+
+/* Flags of a phase lock trace record */
+#define PHASELOCK_FILLING      0x01	/* too few samples, no decision yet */
+#define PHASELOCK_INCONSISTENT 0x02	/* no line fits all error bars */
+#define PHASELOCK_MAXSEG       0x04	/* maxseg vs. save_min inconsistency */
+#define PHASELOCK_MINSEG       0x08	/* minseg vs. save_max inconsistency */
+#define PHASELOCK_BOTH_SIDES   0x10	/* find_df() constrained both ways */
+#define PHASELOCK_OUTLIER      0x20	/* kalman, sample rejected */
+
+/* A line in skew vs. time, or point in freq vs. offset space */
+struct phaselock_line {
+	double slope;		/* ppm */
+	double offset;		/* usec, at the newest sample */
+};
+
+/* Per sample record of the phase lock, see phaselock_subscribe() */
+struct phaselock_trace {
+	unsigned int absolute;	/* sec, time of sample */
+	int    engine;		/* PHASELOCK_POLYGON or PHASELOCK_KALMAN */
+	int    flags;		/* PHASELOCK_FILLING etc. */
+	int    freq;		/* kernel freq, in */
+	int    new_freq;	/* kernel freq, out */
+	double skew;		/* usec, in */
+	double errorbar;	/* usec, in */
+	double delta_f;		/* ppm, frequency change decided on */
+
+	/* polygon: the consistent box and the envelopes' hull vertices */
+	struct phaselock_line save_min, save_max;
+	int    num_max, num_min;
+	const struct phaselock_line *maxseg, *minseg;
+
+	/* kalman: estimates */
+	double est_skew;	/* usec */
+	double est_rate;	/* ppm */
+	double noise;		/* usec, measurement */
+	double wander;		/* ppm^2/sec, frequency random walk */
+};
+
+typedef void (phaselock_trace_fn)(const struct phaselock_trace *t, void *arg);
+
+/* Outcome of a replay or simulation run, see tune.c */
+struct score {
+	double lock;		/* sec until locked/converged, -1 never */
+	double jitter;		/* usec */
+};
+
+/* A server reply, decoded, see packet.c */
+struct ntp_reply {
+	int li, vn, mode, stratum, poll, prec;
+	int delay, disp;		/* root, 16.16 fixed point sec */
+	uint32_t refid;
+	struct ntptime reftime;
+	struct ntptime orgtime;		/* T1 */
+	struct ntptime rectime;		/* T2 */
+	struct ntptime xmttime;		/* T3 */
+
+	double el_time;			/* usec, elapsed: T4 - T1 */
+	double st_time;			/* usec, stall: T3 - T2 */
+	double offset;			/* usec, ((T2 - T1) + (T3 - T4)) / 2 */
+	double root_delay;		/* sec */
+	double root_dispersion;		/* sec */
+};
+
+/* Reference state handed from client to server, see server.c */
+struct ntp_ref {
+	struct ntptime refclk_ts;
+	double root_delay;
+	double root_dispersion;
+	int    stratum;		/* announced, 0: unknown */
+	int    leap;		/* leap indicator of the source */
+	char   refid[4];	/* of a refclock, or zero */
+};
+
+/* Median of the samples from a refclock over one poll, see refclock.c */
+struct refclock_sample {
+	struct ntptime arrival;	/* system clock, latest sample */
+	double offset;		/* usec, reference - system clock */
+	double disp;		/* usec, half interquartile range */
+	unsigned int num;
+	char   refid[4];
+};
+
+/* Server counters, see server.c */
+struct server_stats {
+	unsigned long requests;
+	unsigned long replies;
+	unsigned long drops;	/* invalid, or failed to send */
+};
+
+/* Streaming ADEV, TDEV and MTIE of the offset, see allan.c */
+#define ALLAN_TAUS 16			/* octaves, tau0 .. 2^15 tau0 */
+
+struct allan_level {
+	double t[2], x[2];		/* last two inputs, sec and usec */
+	double avg[2];			/* their block averages */
+	double lo, hi;			/* window of the last input */
+	double sum_adev;		/* second differences squared */
+	double sum_tdev;
+	double sum_tau;
+	double mtie;
+	unsigned long num;		/* inputs */
+	unsigned long count;		/* estimates */
+};
+
+struct allan {
+	struct allan_level level[ALLAN_TAUS];
+	double prev;
+	unsigned long num;
+};
+
+struct allan_point {
+	double tau;			/* sec */
+	double adev;
+	double tdev;			/* usec */
+	double mtie;			/* usec */
+	unsigned long num;		/* estimates */
+};
+
+/* Client state published to the metrics endpoint, see metrics.c */
+struct ntp_metrics {
+	unsigned int last;		/* NTP sec, last sample */
+	double offset;			/* usec */
+	double delay;			/* usec */
+	double jitter;			/* usec */
+	int    freq;			/* ppm * 65536 */
+	int    poll;			/* sec */
+	double root_delay;		/* sec */
+	double root_dispersion;		/* sec */
+	unsigned int reach;		/* 8 bit register, LSB last poll */
+	int    holdover;
+	unsigned long long polls;
+	unsigned long long samples;
+	char   server[64];
+	int    num_dev;
+	struct allan_point dev[ALLAN_TAUS];
+};
+
+/* Binary capture of NTP exchanges, network byte order, see capture.c */
+#define CAPTURE_MAGIC "sntpcap1"
+
+struct capture_hdr {
+	char magic[8];
+	uint32_t reclen;	/* sizeof(struct capture_rec) */
+	uint32_t reserved;
+};
+
+struct capture_rec {
+	struct ntptime t1;	/* local time of send */
+	struct ntptime t4;	/* local time of arrival */
+	int32_t freq;		/* kernel frequency before this reply */
+	uint32_t reserved;
+	uint32_t data[12];	/* reply, as received */
+};
+
+/* Clock backend, replaces the system clock, see clock_override() */
+struct clock_ops {
+	int (*get_freq)(void);
+	int (*set_freq)(int freq);
+	int (*set_time)(double offset, int threshold);
 };
 
 extern struct ntp_peers peer;
 extern const char *prognm;
-extern double min_delay;        /* global tuning parameter */
+extern struct phaselock_param phaselock_defaults;
 extern double root_delay;
 extern double root_dispersion;
 
+/* allan.c */
+void allan_reset(struct allan *a);
+void allan_add(struct allan *a, double t, double x);
+int  allan_get(const struct allan *a, struct allan_point *p, int max);
+
+/* capture.c */
+int  capture_open (const char *file);
+void capture_write(uint32_t *data, struct ntptime *t1, struct ntptime *t4, int freq);
+void capture_close(void);
+
+/* clock.c */
+void clock_override(const struct clock_ops *backend);
+int get_current_freq(void);
+int set_freq(int new_freq);
+int set_sync(int new_freq, double maxerror, double esterror);
+int set_offset(double offset, double maxerror, double esterror, int poll_exp);
+int set_time(double offset, int threshold);
+
+/* filter.c */
+void filter_reset(struct ntp_filter *f);
+int  filter_add(struct ntp_filter *f, unsigned int absolute, double offset, double delay);
+
 /* logit.c */
 void log_init(int use_syslog, int level);
 void log_exit(void);
+int  log_async(void);
+void log_ratelimit(int on);
+void log_summary(void);
 int  log_str2lvl(char *arg);
+const char *log_lvl2str(int val);
+void log_setlevel(int level);
+int  log_getlevel(void);
 
 void logit(int severity, int syserr, const char *format, ...) __attribute__ ((format (printf, 3, 4)));
 
+/* netlink.c */
+int  netlink_open (void);
+int  netlink_event(int sd);
+void netlink_close(int sd);
+
+/* packet.c */
+void ntpc_gettime(struct ntptime *nt);
+void get_packet_timestamp(int usd, struct ntptime *nt);
+void ntp_request(uint32_t data[12], struct ntptime *time_sent);
+void ntp_decode(const uint32_t *data, const struct ntptime *arrival, struct ntp_reply *r);
+const char *ntp_check(const struct ntp_reply *r, const struct ntptime *sent);
+
 /* phaselock.c */
-int contemplate_data(unsigned int absolute, double skew, double errorbar, int freq);
+struct phaselock;
+
+size_t            phaselock_size   (int window);
+struct phaselock *phaselock_init   (void *mem, int window);
+struct phaselock *phaselock_create (int window);
+void              phaselock_destroy(struct phaselock *pl);
+void              phaselock_reset  (struct phaselock *pl);
+void              phaselock_subscribe(struct phaselock *pl, phaselock_trace_fn *fn, void *arg);
+int               phaselock_feed   (struct phaselock *pl, unsigned int absolute,
+				    double skew, double errorbar, int freq);
+int               phaselock_predict(struct phaselock *pl, unsigned int absolute, int *freq);
+void              phaselock_param  (struct phaselock *pl, const struct phaselock_param *param);
+int               phaselock_tune   (struct phaselock_param *param, char *spec);
+char             *phaselock_spec   (const struct phaselock_param *param, char *buf, size_t len);
+int               phaselock_save   (struct phaselock *pl, FILE *fp);
+int               phaselock_load   (struct phaselock *pl, FILE *fp);
+
+/* refclock.c */
+int  refclock_init(const char *spec);
+int  refclock_poll(struct refclock_sample *rs);
+void refclock_exit(void);
+
+/* replay.c */
+int  replay_load  (int argc, char *argv[]);
+void replay_unload(void);
+int  replay_score (const struct phaselock_param *param, struct score *sc);
+int  replay       (int argc, char *argv[]);
+
+/* sim.c */
+int sim_setup(char *spec);
+int sim_score(struct ntp_control *ntpc, const struct phaselock_param *param, struct score *sc);
+int simulate (struct ntp_control *ntpc, char *spec);
 
 /* sntpd.c */
+int  rfc1305print(uint32_t *data, struct ntptime *arrival, struct ntp_control *ntpc, int *error);
 int  setup_receive(int sd, sa_family_t sin_family, uint16_t port);
-void get_packet_timestamp(int usd, struct ntptime *nt);
-void ntpc_gettime(struct ntptime *nt);
+void holdover(struct ntp_control *ntpc, unsigned int now);
+
+/* state.c */
+int state_save(const char *file, int freq);
+int state_load(const char *file, int *freq, int max_age);
+
+/* timepage.c */
+int  timepage_init(const char *path);
+void timepage_update(const struct ntp_ref *ref, double correction, int poll);
+void timepage_exit(void);
+
+/* trace.c */
+int  trace_open     (const char *spec, int flush);
+int  trace_active   (void);
+void trace_subscribe(struct phaselock *pl);
+void trace_close    (void);
+
+/* tune.c */
+int tune(struct ntp_control *ntpc, int num, char *spec, int argc, char *argv[]);
 
 /* server.c */
-int server_init(uint16_t port);
-int server_recv(int sd);
+int  server_init(uint16_t port);
+void server_update(const struct ntp_ref *ref);
+void server_exit(void);
+void server_stats(struct server_stats *ss);
+
+/* control.c, control_handle() actions */
+#define CONTROL_POLL   1	/* poll now */
+#define CONTROL_RESYNC 2	/* reopen socket, e.g. new server */
+
+int  control_init(const char *path);
+int  control_fds(fd_set *fds, int max);
+int  control_handle(fd_set *fds, struct ntp_control *ntpc);
+void control_exit(void);
+int  control_client(const char *path, const char *cmd);
+
+/* metrics.c */
+int  metrics_init(const char *spec);
+void metrics_get(struct ntp_metrics *m);
+void metrics_server(const char *name);
+void metrics_poll(int poll);
+void metrics_holdover(int freq);
+void metrics_sample(unsigned int absolute, double offset, double delay, int freq,
+		    double rootdelay, double rootdisp);
+void metrics_exit(void);
 
 /* Workaround for missing SIOCGSTAMP after Linux 5.1 64-bit timestamp fixes. */
 #ifndef SIOCGSTAMP
@@ -0,0 +1,172 @@
+/* Time page, clock state published by sntpd in shared memory
+ *
+ * Copyright (C) 2010-2022  Joachim Wiberg <troglobit@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License (Version 2,
+ * June 1991) as published by the Free Software Foundation.  At the
+ * time of writing, that license was published by the FSF with the URL
+ * http://www.gnu.org/copyleft/gpl.html, and is incorporated herein by
+ * reference.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+/*
+ * Header-only reader of the page sntpd -e PATH publishes after every
+ * sample, e.g. /dev/shm/sntpd, for local programs that want the clock
+ * quality or the corrected time without a round-trip to port 123:
+ *
+ *     const struct sntpd_timepage *tp = sntpd_timepage_open("/dev/shm/sntpd");
+ *     struct timespec ts;
+ *     double error;
+ *
+ *     if (tp && !sntpd_timepage_now(tp, &ts, &error))
+ *             printf("%ld.%09ld +/- %.6f\n", ts.tv_sec, ts.tv_nsec, error);
+ *
+ * The page is updated in place under a sequence lock: sntpd bumps seq to
+ * odd before writing and back to even after, a reader retries if it was
+ * odd or changed while it copied.  Reading takes no system call, only
+ * sntpd_timepage_now() reads the clock, from the vDSO.  Needs GCC or
+ * Clang, for the __atomic builtins.
+ *
+ * The offset is a measurement.  With the built-in phase lock sntpd only
+ * steers the frequency, so all of it remains and is the correction.
+ * With the kernel PLL, -k, the kernel slews it out, the correction is 0
+ * and what may remain of the offset is added to the error instead.
+ */
+
+#ifndef SNTPD_TIMEPAGE_H_
+#define SNTPD_TIMEPAGE_H_
+
+#include <fcntl.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#define SNTPD_TIMEPAGE_MAGIC    0x53545031	/* "STP1" */
+#define SNTPD_TIMEPAGE_VERSION  1
+#define SNTPD_TIMEPAGE_SIZE     4096
+
+#define SNTPD_TIMEPAGE_SYNC     0x01	/* disciplined from a source */
+#define SNTPD_TIMEPAGE_HOLDOVER 0x02	/* source lost, on predicted freq */
+#define SNTPD_TIMEPAGE_REFCLOCK 0x04	/* source is a local refclock */
+
+/* Increase in error per second since the update, 15 ppm as in NTP */
+#define SNTPD_TIMEPAGE_PHI      15e-6
+
+struct sntpd_timepage {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t seq;			/* odd while sntpd writes */
+	uint32_t flags;
+
+	int64_t  update_sec;		/* CLOCK_REALTIME of the last sample */
+	int64_t  update_nsec;
+
+	double   offset;		/* sec, source - system clock, as measured */
+	double   correction;		/* sec, part of offset left for readers to add */
+	double   jitter;		/* sec, RMS of offset differences */
+	double   freq;			/* ppm, frequency correction */
+	double   root_delay;		/* sec, to the reference clock */
+	double   root_dispersion;	/* sec */
+	double   max_error;		/* sec, root_delay / 2 + root_dispersion */
+
+	int32_t  stratum;		/* as announced by our server */
+	int32_t  leap;			/* 0: none, 1: +1 s, 2: -1 s, 3: unsynchronized */
+	int32_t  poll;			/* sec */
+	char     refid[4];		/* SHM, SOCK, or zero */
+};
+
+/* Map the page read-only, returns NULL on error, with errno set */
+static inline const struct sntpd_timepage *sntpd_timepage_open(const char *path)
+{
+	const struct sntpd_timepage *tp;
+	void *ptr;
+	int fd;
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd == -1)
+		return NULL;
+
+	ptr = mmap(NULL, SNTPD_TIMEPAGE_SIZE, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (ptr == MAP_FAILED)
+		return NULL;
+
+	tp = (const struct sntpd_timepage *)ptr;
+	if (tp->magic != SNTPD_TIMEPAGE_MAGIC || tp->version != SNTPD_TIMEPAGE_VERSION) {
+		munmap(ptr, SNTPD_TIMEPAGE_SIZE);
+		return NULL;
+	}
+
+	return tp;
+}
+
+static inline void sntpd_timepage_close(const struct sntpd_timepage *tp)
+{
+	if (tp)
+		munmap((void *)tp, SNTPD_TIMEPAGE_SIZE);
+}
+
+/* Consistent copy of the page, returns 0, or -1 if not yet synchronized */
+static inline int sntpd_timepage_read(const struct sntpd_timepage *tp, struct sntpd_timepage *copy)
+{
+	uint32_t seq;
+
+	do {
+		seq = __atomic_load_n(&tp->seq, __ATOMIC_ACQUIRE);
+		memcpy(copy, tp, sizeof(*copy));
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	} while ((seq & 1) || seq != __atomic_load_n(&tp->seq, __ATOMIC_RELAXED));
+
+	return copy->flags & SNTPD_TIMEPAGE_SYNC ? 0 : -1;
+}
+
+/*
+ * The system time plus the correction, and the maximum error, in sec,
+ * grown since the update.  Returns 0, or -1 if not synchronized.
+ */
+static inline int sntpd_timepage_now(const struct sntpd_timepage *tp, struct timespec *ts, double *error)
+{
+	struct sntpd_timepage copy;
+	double age, left;
+	long nsec;
+
+	if (sntpd_timepage_read(tp, &copy))
+		return -1;
+
+	clock_gettime(CLOCK_REALTIME, ts);
+	age = (ts->tv_sec - copy.update_sec) + (ts->tv_nsec - copy.update_nsec) / 1e9;
+
+	nsec = ts->tv_nsec + (long)(copy.correction * 1e9);
+	ts->tv_sec += nsec / 1000000000L;
+	nsec %= 1000000000L;
+	if (nsec < 0) {
+		nsec += 1000000000L;
+		ts->tv_sec--;
+	}
+	ts->tv_nsec = nsec;
+
+	if (error) {
+		left = copy.offset - copy.correction;
+		*error = copy.max_error + copy.jitter + (left > 0 ? left : -left) +
+			(age > 0 ? age : 0) * SNTPD_TIMEPAGE_PHI;
+	}
+
+	return 0;
+}
+
+#endif /* SNTPD_TIMEPAGE_H_ */
+
+/**
+ * Local Variables:
+ *  indent-tabs-mode: t
+ *  c-file-style: "linux"
+ * End:
+ */
@@ -0,0 +1,169 @@
+/* Drift and phase lock state file
+ *
+ * Copyright (C) 2010-2022  Joachim Wiberg <troglobit@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License (Version 2,
+ * June 1991) as published by the Free Software Foundation.  At the
+ * time of writing, that license was published by the FSF with the URL
+ * http://www.gnu.org/copyleft/gpl.html, and is incorporated herein by
+ * reference.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+/*
+ * The state file is plain text, one section per line, to make it easy
+ * to inspect and to survive upgrades:
+ *
+ *     sntpd-state 1
+ *     time 1697700000
+ *     freq -1240000
+ *     ring 16 <num>
+ *     <absolute> <skew> <errorbar> <freq>      (num lines)
+ *     filter <num> <last> <offset> <delay> <jitter>
+ *     <absolute> <offset> <delay>              (num lines)
+ *
+ * It is written to a temporary file which is then renamed, so a crash
+ * or power loss leaves either the old or the new state, never a mix.
+ */
+
+#include "config.h"
+#include <time.h>
+#include "sntpd.h"
+
+#define STATE_VERSION 1
+
+static int filter_save(FILE *fp, struct ntp_filter *f)
+{
+	int i, j;
+
+	fprintf(fp, "filter %d %u %.17g %.17g %.17g\n", f->valid, f->last,
+		f->offset, f->delay, f->jitter);
+	for (i = 0, j = (f->rp + FILTER_SIZE - f->valid) % FILTER_SIZE; i < f->valid;
+	     i++, j = (j + 1) % FILTER_SIZE)
+		fprintf(fp, "%u %.17g %.17g\n", f->sample[j].absolute,
+			f->sample[j].offset, f->sample[j].delay);
+
+	return ferror(fp) ? -1 : 0;
+}
+
+static int filter_load(FILE *fp, struct ntp_filter *f)
+{
+	int i, num;
+
+	filter_reset(f);
+	if (fscanf(fp, " filter %d %u %lf %lf %lf", &num, &f->last, &f->offset,
+		   &f->delay, &f->jitter) != 5 || num < 0 || num > FILTER_SIZE)
+		goto fail;
+
+	for (i = 0; i < num; i++) {
+		if (fscanf(fp, "%u %lf %lf", &f->sample[i].absolute,
+			   &f->sample[i].offset, &f->sample[i].delay) != 3)
+			goto fail;
+	}
+	f->valid = num;
+	f->rp    = num % FILTER_SIZE;
+
+	return 0;
+fail:
+	filter_reset(f);
+	return -1;
+}
+
+/*
+ * Save current frequency, phase lock ring and filter state.  Returns
+ * 0 on success, -1 on error with errno set.
+ */
+int state_save(const char *file, int freq)
+{
+	char tmp[PATH_MAX];
+	FILE *fp;
+
+	if (!file)
+		return 0;
+
+	snprintf(tmp, sizeof(tmp), "%s+", file);
+	fp = fopen(tmp, "w");
+	if (!fp) {
+		ERR(errno, "Failed creating state file %s", tmp);
+		return -1;
+	}
+
+	fprintf(fp, "sntpd-state %d\n", STATE_VERSION);
+	fprintf(fp, "time %lld\n", (long long)time(NULL));
+	fprintf(fp, "freq %d\n", freq);
+	if (peer.pl)
+		phaselock_save(peer.pl, fp);
+	filter_save(fp, &peer.filter);
+
+	if (ferror(fp) || fflush(fp) || fsync(fileno(fp))) {
+		ERR(errno, "Failed writing state file %s", tmp);
+		fclose(fp);
+		unlink(tmp);
+		return -1;
+	}
+	fclose(fp);
+
+	if (rename(tmp, file)) {
+		ERR(errno, "Failed saving state file %s", file);
+		unlink(tmp);
+		return -1;
+	}
+
+	DBG("Saved state to %s, freq %d", file, freq);
+	return 0;
+}
+
+/*
+ * Load state saved by state_save().  The frequency is always restored,
+ * but the ring and filter only if they are younger than max_age sec,
+ * otherwise their samples are no longer relevant.  Returns 0 and the
+ * frequency in *freq on success, -1 if there was no usable state.
+ */
+int state_load(const char *file, int *freq, int max_age)
+{
+	long long saved, now;
+	int version;
+	FILE *fp;
+
+	if (!file)
+		return -1;
+
+	fp = fopen(file, "r");
+	if (!fp) {
+		if (errno != ENOENT)
+			ERR(errno, "Failed opening state file %s", file);
+		return -1;
+	}
+
+	if (fscanf(fp, "sntpd-state %d", &version) != 1 || version != STATE_VERSION ||
+	    fscanf(fp, " time %lld", &saved) != 1 ||
+	    fscanf(fp, " freq %d", freq) != 1) {
+		ERR(0, "Invalid state file %s, ignoring", file);
+		fclose(fp);
+		return -1;
+	}
+
+	now = time(NULL);
+	if (now < saved || now - saved > max_age) {
+		LOG("State file %s is %lld sec old, restoring frequency only", file, now - saved);
+	} else if (!peer.pl || phaselock_load(peer.pl, fp) || filter_load(fp, &peer.filter)) {
+		ERR(0, "Invalid phase lock state in %s, restoring frequency only", file);
+	} else {
+		LOG("Restored state from %s, %lld sec old", file, now - saved);
+	}
+	fclose(fp);
+
+	return 0;
+}
+
+/**
+ * Local Variables:
+ *  indent-tabs-mode: t
+ *  c-file-style: "linux"
+ * End:
+ */
@@ -0,0 +1,154 @@
+/* Time page, publish clock state in shared memory for local programs
+ *
+ * Copyright (C) 2010-2022  Joachim Wiberg <troglobit@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License (Version 2,
+ * June 1991) as published by the Free Software Foundation.  At the
+ * time of writing, that license was published by the FSF with the URL
+ * http://www.gnu.org/copyleft/gpl.html, and is incorporated herein by
+ * reference.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+/*
+ * Writer side of sntpd_timepage.h.  The page is a file, e.g. in
+ * /dev/shm, readable by all, mapped by sntpd and updated after each
+ * sample with the same seqlock as server.c.  At exit the page is marked
+ * unsynchronized and removed, readers still holding it see the flag.
+ */
+
+#include "config.h"
+#include <sys/stat.h>
+#include "sntpd.h"
+#include "sntpd_timepage.h"
+
+static struct sntpd_timepage *page;
+static char *page_path;
+
+static void timepage_begin(void)
+{
+	unsigned int seq = __atomic_load_n(&page->seq, __ATOMIC_RELAXED);
+
+	__atomic_store_n(&page->seq, seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static void timepage_end(void)
+{
+	unsigned int seq = __atomic_load_n(&page->seq, __ATOMIC_RELAXED);
+
+	__atomic_store_n(&page->seq, seq + 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * Create the page at path, replacing any old one, so readers that still
+ * have the old page mapped are not mixed up.  Returns 0 or -1 on error.
+ */
+int timepage_init(const char *path)
+{
+	void *ptr;
+	int fd;
+
+	unlink(path);
+	fd = open(path, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+	if (fd == -1)
+		goto fail;
+
+	/* Readable by all, regardless of umask */
+	if (fchmod(fd, 0644) || ftruncate(fd, SNTPD_TIMEPAGE_SIZE)) {
+		close(fd);
+		unlink(path);
+		goto fail;
+	}
+
+	ptr = mmap(NULL, SNTPD_TIMEPAGE_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (ptr == MAP_FAILED) {
+		unlink(path);
+		goto fail;
+	}
+
+	page = ptr;
+	page->version = SNTPD_TIMEPAGE_VERSION;
+	page->leap    = 3;
+	__atomic_store_n(&page->magic, SNTPD_TIMEPAGE_MAGIC, __ATOMIC_RELEASE);
+	page_path = strdup(path);
+
+	return 0;
+fail:
+	ERR(errno, "Failed creating time page %s", path);
+	return -1;
+}
+
+/*
+ * Called after each sample with the reference state and the part of
+ * the offset not corrected by sntpd, in sec, and with ref NULL when only
+ * the holdover state or the poll interval changed.
+ */
+void timepage_update(const struct ntp_ref *ref, double correction, int poll)
+{
+	struct ntp_metrics m;
+	struct timespec now;
+
+	if (!page)
+		return;
+
+	metrics_get(&m);
+	clock_gettime(CLOCK_REALTIME, &now);
+
+	timepage_begin();
+	if (ref) {
+		page->update_sec      = now.tv_sec;
+		page->update_nsec     = now.tv_nsec;
+		page->offset          = m.offset / 1e6;
+		page->correction      = correction;
+		page->jitter          = m.jitter / 1e6;
+		page->freq            = m.freq / 65536.0;
+		page->root_delay      = ref->root_delay;
+		page->root_dispersion = ref->root_dispersion;
+		page->max_error       = ref->root_delay / 2 + ref->root_dispersion;
+		page->stratum         = ref->stratum;
+		page->leap            = ref->leap;
+		memcpy(page->refid, ref->refid, sizeof(page->refid));
+
+		page->flags = SNTPD_TIMEPAGE_SYNC;
+		if (ref->refid[0])
+			page->flags |= SNTPD_TIMEPAGE_REFCLOCK;
+	}
+	if (m.holdover)
+		page->flags |= SNTPD_TIMEPAGE_HOLDOVER;
+	else
+		page->flags &= ~SNTPD_TIMEPAGE_HOLDOVER;
+	page->poll = poll;
+	timepage_end();
+}
+
+void timepage_exit(void)
+{
+	if (!page)
+		return;
+
+	timepage_begin();
+	page->flags = 0;
+	page->leap  = 3;
+	timepage_end();
+
+	munmap(page, SNTPD_TIMEPAGE_SIZE);
+	page = NULL;
+
+	unlink(page_path);
+	free(page_path);
+	page_path = NULL;
+}
+
+/**
+ * Local Variables:
+ *  indent-tabs-mode: t
+ *  c-file-style: "linux"
+ * End:
+ */
@@ -0,0 +1,195 @@
+/* Phase lock trace, for studies of the loop behaviour
+ *
+ * Copyright (C) 2010-2022  Joachim Wiberg <troglobit@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License (Version 2,
+ * June 1991) as published by the Free Software Foundation.  At the
+ * time of writing, that license was published by the FSF with the URL
+ * http://www.gnu.org/copyleft/gpl.html, and is incorporated herein by
+ * reference.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+/*
+ * Subscribes to the phase lock and writes one record per sample, see
+ * struct phaselock_trace, in one of two formats.  CSV, the default, one
+ * line per sample followed by one per hull vertex:
+ *
+ *     sample,<absolute>,<engine>,<flags>,<freq>,<new_freq>,<skew>,
+ *            <errorbar>,<delta_f>,<min_slope>,<min_offset>,<max_slope>,
+ *            <max_offset>,<est_skew>,<est_rate>,<noise>,<wander>
+ *     maxseg,<absolute>,<slope>,<offset>
+ *     minseg,<absolute>,<slope>,<offset>
+ *
+ * or binary, host byte order, a struct trace_hdr followed by, for each
+ * sample, a struct trace_rec and num_max + num_min struct phaselock_line,
+ * maxseg first.  See docs/envelope for a consumer.
+ */
+
+#include "config.h"
+#include "sntpd.h"
+
+#define TRACE_MAGIC "sntptrc1"
+
+struct trace_hdr {
+	char magic[8];
+	uint32_t reclen;	/* sizeof(struct trace_rec) */
+	uint32_t linelen;	/* sizeof(struct phaselock_line) */
+};
+
+struct trace_rec {
+	uint32_t absolute;
+	int32_t  engine;
+	int32_t  flags;
+	int32_t  freq;
+	int32_t  new_freq;
+	uint16_t num_max;
+	uint16_t num_min;
+	double   skew, errorbar, delta_f;
+	double   min_slope, min_offset, max_slope, max_offset;
+	double   est_skew, est_rate, noise, wander;
+};
+
+static FILE *fp;
+static int binary;
+static int live;
+
+static void trace_csv(const struct phaselock_trace *t)
+{
+	int i;
+
+	fprintf(fp, "sample,%u,%s,%d,%d,%d,%.3f,%.3f,%.6f,%.6f,%.3f,%.6f,%.3f,%.3f,%.6f,%.3f,%g\n",
+		t->absolute, t->engine == PHASELOCK_KALMAN ? "kalman" : "polygon",
+		t->flags, t->freq, t->new_freq, t->skew, t->errorbar, t->delta_f,
+		t->save_min.slope, t->save_min.offset, t->save_max.slope, t->save_max.offset,
+		t->est_skew, t->est_rate, t->noise, t->wander);
+	for (i = 0; i < t->num_max; i++)
+		fprintf(fp, "maxseg,%u,%.6f,%.3f\n", t->absolute, t->maxseg[i].slope, t->maxseg[i].offset);
+	for (i = 0; i < t->num_min; i++)
+		fprintf(fp, "minseg,%u,%.6f,%.3f\n", t->absolute, t->minseg[i].slope, t->minseg[i].offset);
+}
+
+static void trace_bin(const struct phaselock_trace *t)
+{
+	struct trace_rec rec = {
+		.absolute   = t->absolute,
+		.engine     = t->engine,
+		.flags      = t->flags,
+		.freq       = t->freq,
+		.new_freq   = t->new_freq,
+		.num_max    = t->num_max,
+		.num_min    = t->num_min,
+		.skew       = t->skew,
+		.errorbar   = t->errorbar,
+		.delta_f    = t->delta_f,
+		.min_slope  = t->save_min.slope,
+		.min_offset = t->save_min.offset,
+		.max_slope  = t->save_max.slope,
+		.max_offset = t->save_max.offset,
+		.est_skew   = t->est_skew,
+		.est_rate   = t->est_rate,
+		.noise      = t->noise,
+		.wander     = t->wander,
+	};
+
+	fwrite(&rec, sizeof(rec), 1, fp);
+	fwrite(t->maxseg, sizeof(*t->maxseg), t->num_max, fp);
+	fwrite(t->minseg, sizeof(*t->minseg), t->num_min, fp);
+}
+
+static void trace_record(const struct phaselock_trace *t, void *arg)
+{
+	(void)arg;
+
+	if (!fp)
+		return;
+
+	if (binary)
+		trace_bin(t);
+	else
+		trace_csv(t);
+
+	if (live)
+		fflush(fp);
+	if (ferror(fp)) {
+		ERR(errno, "Failed writing phase lock trace, stopping trace");
+		trace_close();
+	}
+}
+
+/*
+ * Open trace, spec is [csv:|bin:]FILE, or - for stdout.  With flush
+ * set, e.g. when running as daemon, each record is flushed at once.
+ * Returns 0 on success, -1 on error.
+ */
+int trace_open(const char *spec, int flush)
+{
+	const char *file = spec;
+
+	binary = 0;
+	if (!strncmp(spec, "bin:", 4)) {
+		binary = 1;
+		file  += 4;
+	} else if (!strncmp(spec, "csv:", 4)) {
+		file  += 4;
+	}
+
+	if (!strcmp(file, "-"))
+		fp = stdout;
+	else
+		fp = fopen(file, binary ? "wb" : "w");
+	if (!fp) {
+		ERR(errno, "Failed opening phase lock trace %s", file);
+		return -1;
+	}
+	live = flush;
+
+	if (binary) {
+		struct trace_hdr hdr;
+
+		memset(&hdr, 0, sizeof(hdr));
+		memcpy(hdr.magic, TRACE_MAGIC, sizeof(hdr.magic));
+		hdr.reclen  = sizeof(struct trace_rec);
+		hdr.linelen = sizeof(struct phaselock_line);
+		fwrite(&hdr, sizeof(hdr), 1, fp);
+	}
+
+	return 0;
+}
+
+/* Is a trace open? */
+int trace_active(void)
+{
+	return fp != NULL;
+}
+
+/* Subscribe phase lock instance to the trace, if one is open */
+void trace_subscribe(struct phaselock *pl)
+{
+	if (pl)
+		phaselock_subscribe(pl, fp ? trace_record : NULL, NULL);
+}
+
+void trace_close(void)
+{
+	if (!fp)
+		return;
+
+	if (fp != stdout)
+		fclose(fp);
+	else
+		fflush(fp);
+	fp = NULL;
+}
+
+/**
+ * Local Variables:
+ *  indent-tabs-mode: t
+ *  c-file-style: "linux"
+ * End:
+ */
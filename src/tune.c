@@ -0,0 +1,153 @@
+/* Offline tuning of the phase lock parameters, developer mode
+ *
+ * Copyright (C) 2010-2022  Joachim Wiberg <troglobit@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License (Version 2,
+ * June 1991) as published by the Free Software Foundation.  At the
+ * time of writing, that license was published by the FSF with the URL
+ * http://www.gnu.org/copyleft/gpl.html, and is incorporated herein by
+ * reference.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+/*
+ * Random search around the current parameters, -T or the defaults.
+ * The engine is kept, and each candidate scales every parameter, except
+ * max_correct which is a safety limit, by a factor between 1/TUNE_RANGE
+ * and TUNE_RANGE, log uniform.  Candidates are scored on a simulated
+ * scenario, see sim.c, or on replay logs, see replay.c.
+ *
+ * There is no single best set, faster lock usually costs jitter, so
+ * the candidates not beaten on both by any other are reported, fastest
+ * first.  Any line can be used as is with -T.
+ */
+
+#include "config.h"
+#include <math.h>
+#include "sntpd.h"
+
+#define TUNE_RANGE 4.0
+
+struct candidate {
+	struct phaselock_param param;
+	struct score score;
+	int valid;
+};
+
+/* Scale all but max_correct, each by a random log uniform factor */
+static void mutate(struct phaselock_param *p, unsigned short rng[3])
+{
+	double *val[] = {
+		&p->min_delay, &p->min_init, &p->shift_fast, &p->shift_slow,
+		&p->shift_bias, &p->crit_time, &p->center_fast, &p->center_slow,
+		&p->kalman_tau,
+	};
+	size_t i;
+
+	for (i = 0; i < sizeof(val) / sizeof(val[0]); i++)
+		*val[i] *= exp(log(TUNE_RANGE) * (2 * erand48(rng) - 1));
+}
+
+/* Is a at least as good as b on both, and better on one? */
+static int dominates(struct score *a, struct score *b)
+{
+	return a->lock <= b->lock && a->jitter <= b->jitter &&
+		(a->lock < b->lock || a->jitter < b->jitter);
+}
+
+static int by_lock(const void *a, const void *b)
+{
+	const struct candidate *x = a, *y = b;
+
+	if (x->score.lock != y->score.lock)
+		return x->score.lock < y->score.lock ? -1 : 1;
+	if (x->score.jitter != y->score.jitter)
+		return x->score.jitter < y->score.jitter ? -1 : 1;
+
+	return 0;
+}
+
+/*
+ * Try num parameter sets, on the simulator if spec is set, otherwise
+ * on the replay logs in argv[], or stdin.  Prints the best to stdout.
+ */
+int tune(struct ntp_control *ntpc, int num, char *spec, int argc, char *argv[])
+{
+	unsigned short rng[3] = { 0x330e, 0x1234, 0xabcd };
+	struct candidate *c;
+	char buf[256];
+	int i, j, rc = 1;
+
+	if (num < 1)
+		num = 1;
+
+	if (spec) {
+		if (sim_setup(spec))
+			return 1;
+	} else if (replay_load(argc, argv)) {
+		return 1;
+	}
+
+	c = calloc(num, sizeof(*c));
+	if (!c) {
+		ERR(errno, "Failed allocating tuning candidates");
+		goto done;
+	}
+
+	for (i = 0; i < num; i++) {
+		c[i].param = phaselock_defaults;
+		if (i > 0)
+			mutate(&c[i].param, rng);
+
+		if (spec)
+			j = sim_score(ntpc, &c[i].param, &c[i].score);
+		else
+			j = replay_score(&c[i].param, &c[i].score);
+		c[i].valid = !j && c[i].score.lock >= 0;
+
+		if (i == 0) {
+			if (!c[i].valid)
+				printf("# current: never locks\n");
+			else
+				printf("# current: lock %.0f s, jitter %.1f us\n",
+				       c[i].score.lock, c[i].score.jitter);
+		}
+	}
+
+	/* keep only the candidates no other beats on both lock and jitter */
+	for (i = 0; i < num; i++) {
+		for (j = 0; c[i].valid && j < num; j++) {
+			if (c[j].valid && dominates(&c[j].score, &c[i].score))
+				c[i].valid = 0;
+		}
+	}
+	qsort(c, num, sizeof(*c), by_lock);
+
+	printf("%-10s %10s  %s\n", "# lock/s", "jitter/us", "parameters");
+	for (i = 0; i < num; i++) {
+		if (!c[i].valid)
+			continue;
+
+		printf("%10.0f %10.1f  %s\n", c[i].score.lock, c[i].score.jitter,
+		       phaselock_spec(&c[i].param, buf, sizeof(buf)));
+	}
+	free(c);
+	rc = 0;
+done:
+	if (!spec)
+		replay_unload();
+
+	return rc;
+}
+
+/**
+ * Local Variables:
+ *  indent-tabs-mode: t
+ *  c-file-style: "linux"
+ * End:
+ */